@@ -0,0 +1,51 @@
+//
+// BinaryJournal.h
+//
+// Layout of the binary journal format, shared by JournalParser and
+// JournalWriter. The text format is version 1.
+//
+// (c) 2014 Graham West
+
+#if !defined(BINARYJOURNAL_H)
+#define BINARYJOURNAL_H
+
+// Library headers.
+#include <QtGlobal>
+
+// All numbers are little-endian. The file starts with the magic and a
+// quint32 version, followed by records, each of which is:
+//
+//   length      quint32 count of payload bytes
+//   checksum    quint32 CRC-32C of the payload
+//   payload     a type byte, then what that type holds
+//
+// A string record holds a string's UTF-8 bytes, up to the end of the
+// payload. Strings are numbered from 1 in the order they are written, and
+// each is written before the first line that uses it.
+//
+// A line record holds one journal line: a quint32 count of updates, then
+// for each one a quint32 count of path parts, that many string numbers
+// (the file ID first), a value type byte, and the value. A string value
+// is a quint32 byte length and its UTF-8 bytes; an integer is a qint64.
+//
+// Each line is applied as a whole, or not at all, just as a text line is.
+namespace BinaryJournal
+{
+	static const char MAGIC[4] = { 'C', 'C', 'J', 'B' };
+	static const quint32 VERSION = 2;
+
+	static const int HEADER_SIZE = sizeof(MAGIC) + sizeof(quint32);
+	static const int RECORD_HEADER_SIZE = 2 * sizeof(quint32);
+
+	enum RecordType {
+		RECORD_STRING = 1,
+		RECORD_LINE = 2
+	};
+
+	enum ValueType {
+		VALUE_STRING = 1,
+		VALUE_INTEGER = 2
+	};
+}
+
+#endif // BINARYJOURNAL_H
@@ -0,0 +1,122 @@
+//
+// DataArena.cpp
+//
+// Hand out memory for the nodes of one data file's hierarchy from a few large
+// blocks, which are all freed together when the file is dropped.
+//
+// (c) 2014 Graham West
+
+// Class header, always comes first.
+#include "DataArena.h"
+
+// Application headers.
+#include "DataSource.h"
+
+// Every allocation is rounded up to this, which suits pointers and qint64s.
+static const size_t ALIGNMENT = 8;
+
+DataArena::DataArena(int blockSize) : m_Next(0), m_End(0),
+	m_BlockSize(blockSize), m_BytesAllocated(0), m_Damaged(false)
+{
+}
+
+DataArena::~DataArena()
+{
+	for (int count = 0; count < m_Blocks.size(); count++)
+	{
+		delete [] m_Blocks[count];
+	}
+
+	for (int count = 0; count < m_Merged.size(); count++)
+	{
+		delete m_Merged[count];
+	}
+}
+
+void* DataArena::Allocate(size_t bytes)
+{
+	void* retval = 0;
+
+	bytes = (bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+	if (bytes > static_cast<size_t>(m_BlockSize / 4))
+	{
+		// Big requests get a block of their own, so they don't waste the
+		// rest of the current one.
+		char* block = new char[bytes];
+		m_Blocks.push_back(block);
+		retval = block;
+	}
+	else
+	{
+		if (static_cast<size_t>(m_End - m_Next) < bytes)
+		{
+			m_Next = new char[m_BlockSize];
+			m_End = m_Next + m_BlockSize;
+			m_Blocks.push_back(m_Next);
+		}
+
+		retval = m_Next;
+		m_Next += bytes;
+	}
+
+	m_BytesAllocated += bytes;
+
+	return retval;
+}
+
+void DataArena::Merge(DataArena* src)
+{
+	if (src && src != this)
+	{
+		m_Merged.push_back(src);
+	}
+}
+
+qint64 DataArena::BytesAllocated() const
+{
+	qint64 retval = m_BytesAllocated;
+
+	for (int count = 0; count < m_Merged.size(); count++)
+	{
+		retval += m_Merged[count]->BytesAllocated();
+	}
+
+	return retval;
+}
+
+bool DataArena::Damaged() const
+{
+	bool retval = m_Damaged;
+
+	for (int count = 0; !retval && count < m_Merged.size(); count++)
+	{
+		retval = m_Merged[count]->Damaged();
+	}
+
+	return retval;
+}
+
+void DataArena::KeepAlive(const QSharedPointer<DataSource>& source)
+{
+	if (!source.isNull() && Source(source.data()).isNull())
+	{
+		m_Sources.push_back(source);
+	}
+}
+
+QSharedPointer<DataSource> DataArena::Source(const DataSource* source) const
+{
+	QSharedPointer<DataSource> retval;
+
+	// There's rarely more than one.
+	for (int count = 0; retval.isNull() && count < m_Sources.size(); count++)
+	{
+		if (m_Sources[count].data() == source)
+		{
+			retval = m_Sources[count];
+		}
+	}
+
+	return retval;
+}
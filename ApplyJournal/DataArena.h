@@ -0,0 +1,67 @@
+//
+// DataArena.h
+//
+// Hand out memory for the nodes of one data file's hierarchy from a few large
+// blocks, which are all freed together when the file is dropped.
+//
+// (c) 2014 Graham West
+
+#if !defined(DATAARENA_H)
+#define DATAARENA_H
+
+// System headers.
+#include <stddef.h>
+
+// Library headers.
+#include <QSharedPointer>
+#include <QVector>
+
+class DataSource;
+
+// Nothing allocated from an arena is ever destroyed on its own, so it mustn't
+// own anything outside the arena. An arena is only used by one thread at a
+// time.
+class DataArena
+{
+public:
+	static const int DEFAULT_BLOCK_SIZE = 1024 * 1024;
+
+	DataArena(int blockSize = DEFAULT_BLOCK_SIZE);
+	~DataArena();
+
+	void* Allocate(size_t bytes);
+
+	// Take ownership of src. Nodes made in it still allocate from it, so it
+	// is kept, rather than emptied, and deleted along with this arena.
+	void Merge(DataArena* src);
+
+	// Lazy structs allocated here share the arena's lifetime, so the arena
+	// keeps the text they refer to alive rather than each of them.
+	void KeepAlive(const QSharedPointer<DataSource>& source);
+	QSharedPointer<DataSource> Source(const DataSource* source) const;
+
+	// Including every arena merged in.
+	qint64 BytesAllocated() const;
+
+	// Set when a lazily read struct in the arena turns out to be malformed
+	// once it's parsed. Its hierarchy is then missing whatever came after the
+	// error, so it mustn't be saved. Includes every arena merged in.
+	inline void Damaged(bool newDamaged) { m_Damaged = newDamaged; }
+	bool Damaged() const;
+
+private:
+	DataArena(const DataArena& src);
+	DataArena& operator=(const DataArena& src);
+
+	QVector<char*> m_Blocks;
+	char* m_Next;
+	char* m_End;
+	int m_BlockSize;
+	qint64 m_BytesAllocated;
+	bool m_Damaged;
+
+	QVector<QSharedPointer<DataSource> > m_Sources;
+	QVector<DataArena*> m_Merged;
+};
+
+#endif // DATAARENA_H
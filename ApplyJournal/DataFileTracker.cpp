@@ -9,6 +9,7 @@
 #include "DataFileTracker.h"
 
 // Library headers.
+#include <QBitArray>
 
 // Common headers.
 #include "StringDeduplicator.h"
@@ -19,9 +20,17 @@ DataFileTracker::DataFileTracker()
 
 DataFileTracker::~DataFileTracker()
 {
+	FilesMap::iterator iter = m_Files.begin();
+
+	while (iter != m_Files.end())
+	{
+		Release(*iter);
+		iter++;
+	}
 }
 
-bool DataFileTracker::Add(const QString& fileName, const QString& id, DataHierarchy* hierarchy)
+bool DataFileTracker::Add(const QString& fileName, const QString& id,
+	DataHierarchy* hierarchy, DataArena* arena, bool snapshot)
 {
 	bool retval = false;
 
@@ -30,7 +39,9 @@ bool DataFileTracker::Add(const QString& fileName, const QString& id, DataHierar
 		FileInfo newFile;
 		newFile.fileName = fileName;
 		newFile.hierarchy = hierarchy;
+		newFile.arena = arena;
 		newFile.loaded = QDateTime::currentDateTime();
+		newFile.snapshot = snapshot;
 
 		m_Files.insert(id, newFile);
 		retval = true;
@@ -39,6 +50,22 @@ bool DataFileTracker::Add(const QString& fileName, const QString& id, DataHierar
 	return retval;
 }
 
+bool DataFileTracker::Remove(const QString& id)
+{
+	bool retval = false;
+
+	FilesMap::iterator iter = m_Files.find(id);
+
+	if (iter != m_Files.end())
+	{
+		Release(*iter);
+		m_Files.erase(iter);
+		retval = true;
+	}
+
+	return retval;
+}
+
 DataHierarchy* DataFileTracker::Hierarchy(const QString& id)
 {
 	DataHierarchy* retval = 0;
@@ -65,3 +92,41 @@ void DataFileTracker::Files(DataFileTracker::FilesInfo& filesDest)
 		iter++;
 	}
 }
+
+int DataFileTracker::Compact()
+{
+	int before = StringDeduplicator::Total();
+	QBitArray live(before + 1);
+	QVector<uint> newIds;
+
+	FilesMap::iterator iter = m_Files.begin();
+
+	while (iter != m_Files.end())
+	{
+		iter->hierarchy->CollectIds(live);
+		iter++;
+	}
+
+	StringDeduplicator::Compact(live, newIds);
+
+	iter = m_Files.begin();
+
+	while (iter != m_Files.end())
+	{
+		iter->hierarchy->RemapIds(newIds);
+		iter++;
+	}
+
+	return (before - StringDeduplicator::Total());
+}
+
+void DataFileTracker::Release(FileInfo& info)
+{
+	// A hierarchy in an arena is freed a block at a time with it, rather
+	// than a node at a time.
+	DataHierarchy::Destroy(info.hierarchy);
+	delete info.arena;
+
+	info.hierarchy = 0;
+	info.arena = 0;
+}
@@ -15,15 +15,20 @@
 #include <QVector>
 
 // Application headers.
+#include "DataArena.h"
 #include "DataHierarchy.h"
 
 class DataFileTracker
 {
 public:
+	// The tracker owns the hierarchy, and the arena it was read into if it
+	// has one. A file read from a binary snapshot is saved as one again.
 	typedef struct FileInfo {
 		QString fileName;
 		DataHierarchy* hierarchy;
+		DataArena* arena;
 		QDateTime loaded;
+		bool snapshot;
 	} FileInfo;
 
 	typedef QVector<FileInfo> FilesInfo;
@@ -31,17 +36,28 @@ public:
 	DataFileTracker();
 	~DataFileTracker();
 
-	bool Add(const QString& fileName, const QString& id, DataHierarchy* hierarchy);
+	bool Add(const QString& fileName, const QString& id, DataHierarchy* hierarchy,
+		DataArena* arena = 0, bool snapshot = false);
+	bool Remove(const QString& id);
 
 	DataHierarchy* Hierarchy(const QString& id);
 	void Files(FilesInfo& filesDest);
 
+	// Values replaced or removed leave their strings behind in the
+	// deduplicator. This drops every string none of the tracked hierarchies
+	// still uses and renumbers the rest, so it mustn't run while anything
+	// else is reading, parsing or holding string IDs. Returns the number of
+	// strings dropped.
+	int Compact();
+
 private:
 	DataFileTracker(const DataFileTracker& src);
 	DataFileTracker& operator=(const DataFileTracker& src);
 
 	typedef QMap<QString, FileInfo> FilesMap;
 
+	static void Release(FileInfo& info);
+
 	FilesMap m_Files;
 };
 
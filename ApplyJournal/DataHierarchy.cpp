@@ -9,28 +9,40 @@
 // Class header, always comes first.
 #include "DataHierarchy.h"
 
+// System headers.
+#include <new>
+
 // Common headers.
+#include "ErrorLogger.h"
 #include "StringDeduplicator.h"
+#include "StringUtils.h"
 
-static QString emptyStr("");
+// Application headers.
+#include "DataArena.h"
+#include "DataReader.h"
+#include "DataSource.h"
 
-DataValue::DataValue() : m_Type(INVALID), m_BasicValue(0), m_StructValue(0)
+DataValue::DataValue() : m_Type(INVALID), m_BasicValue(0)
 {
+	m_Payload.integerValue = 0;
 }
 
 DataValue::DataValue(uint basicValue) : m_Type(BASIC),
-	m_BasicValue(basicValue), m_StructValue(0)
+	m_BasicValue(basicValue)
 {
+	m_Payload.integerValue = 0;
 }
 
 DataValue::DataValue(DataHierarchy* structValue) : m_Type(STRUCT),
-	m_BasicValue(0), m_StructValue(structValue)
+	m_BasicValue(0)
 {
+	m_Payload.integerValue = 0;
+	m_Payload.structValue = structValue;
 }
 
 DataValue::DataValue(const DataValue& src) :
 	m_Type(src.m_Type), m_BasicValue(src.m_BasicValue),
-	m_StructValue(src.m_StructValue)
+	m_Payload(src.m_Payload)
 {
 }
 
@@ -42,16 +54,26 @@ DataValue& DataValue::operator=(const DataValue& src)
 {
 	m_Type = src.m_Type;
 	m_BasicValue = src.m_BasicValue;
-	m_StructValue = src.m_StructValue;
+	m_Payload = src.m_Payload;
 	
 	return *this;
 }
 
+DataValue DataValue::Integer(qint64 integerValue)
+{
+	DataValue retval;
+
+	retval.m_Type = INTEGER;
+	retval.m_Payload.integerValue = integerValue;
+
+	return retval;
+}
+
 uint DataValue::BasicValue() const
 {
 	uint retval = 0;
 
-	if (IsBasic())
+	if (m_Type == BASIC)
 	{
 		retval = m_BasicValue;
 	}
@@ -59,16 +81,32 @@ uint DataValue::BasicValue() const
 	return retval;
 }
 
-const QString& DataValue::BasicString() const
+qint64 DataValue::IntegerValue() const
 {
-	if (IsBasic())
+	qint64 retval = 0;
+
+	if (IsInteger())
 	{
-		return StringDeduplicator::Retrieve(m_BasicValue);
+		retval = m_Payload.integerValue;
 	}
-	else
+
+	return retval;
+}
+
+QString DataValue::BasicString() const
+{
+	QString retval("");
+
+	if (IsInteger())
 	{
-		return emptyStr;
+		retval = QString::number(m_Payload.integerValue);
 	}
+	else if (IsBasic())
+	{
+		retval = StringDeduplicator::Retrieve(m_BasicValue).ToString();
+	}
+
+	return retval;
 }
 
 DataHierarchy* DataValue::StructValue() const
@@ -77,48 +115,288 @@ DataHierarchy* DataValue::StructValue() const
 
 	if (IsStruct())
 	{
-		retval = m_StructValue;
+		retval = m_Payload.structValue;
 	}
 	
 	return retval;
 }
 
-DataHierarchy::DataHierarchy()
+DataChildren::DataChildren(DataArena* arena) : m_Entries(m_Inline), m_Size(0),
+	m_Capacity(INLINE_CHILDREN), m_Index(0), m_IndexSize(0), m_Arena(arena)
 {
 }
 
-DataHierarchy::~DataHierarchy()
+DataChildren::~DataChildren()
 {
-	// The DataValue instances don't delete a struct value, so we have
-	// to do that ourselves.
-	if (!m_Children.isEmpty())
+	FreeStorage();
+}
+
+int DataChildren::IndexOf(uint key) const
+{
+	int retval = -1;
+
+	if (!m_Index)
 	{
-		ChildrenMap::iterator iter = m_Children.begin();
+		int count = 0;
 
-		while (iter != m_Children.end())
+		while (retval < 0 && count < m_Size)
 		{
-			if (iter->IsStruct() && iter->StructValue())
+			if (m_Entries[count].key == key)
 			{
-				delete iter->StructValue();
+				retval = count;
 			}
 
-			iter++;
+			count++;
 		}
 	}
+	else
+	{
+		uint mask = static_cast<uint>(m_IndexSize - 1);
+		uint slot = Slot(key) & mask;
+
+		while (retval < 0 && m_Index[slot] != 0)
+		{
+			if (m_Entries[m_Index[slot] - 1].key == key)
+			{
+				retval = m_Index[slot] - 1;
+			}
+
+			slot = (slot + 1) & mask;
+		}
+	}
+
+	return retval;
+}
+
+void DataChildren::Append(uint key, const DataValue& value)
+{
+	if (m_Size == m_Capacity)
+	{
+		// Storage from an arena can't be given back, so the old entries
+		// are simply left behind there.
+		Entry* entries = NewEntries(m_Capacity * 2);
+
+		for (int count = 0; count < m_Size; count++)
+		{
+			entries[count] = m_Entries[count];
+		}
+
+		if (!m_Arena && m_Entries != m_Inline)
+		{
+			delete [] m_Entries;
+		}
+
+		m_Entries = entries;
+		m_Capacity *= 2;
+	}
+
+	m_Entries[m_Size].key = key;
+	m_Entries[m_Size].value = value;
+	m_Size++;
+
+	if (m_Size > INDEX_THRESHOLD)
+	{
+		// Keep the index no more than half full, so probes stay short.
+		if (m_IndexSize < m_Size * 2)
+		{
+			Rehash(m_Index ? m_IndexSize * 2 : INDEX_THRESHOLD * 4);
+		}
+		else
+		{
+			AddToIndex(m_Size - 1);
+		}
+	}
+}
+
+void DataChildren::Clear()
+{
+	FreeStorage();
+
+	m_Entries = m_Inline;
+	m_Size = 0;
+	m_Capacity = INLINE_CHILDREN;
+	m_Index = 0;
+	m_IndexSize = 0;
+}
+
+void DataChildren::RemapIds(const QVector<uint>& newIds)
+{
+	for (int count = 0; count < m_Size; count++)
+	{
+		Entry& entry = m_Entries[count];
+		uint valueId = entry.value.BasicValue();
+
+		entry.key = newIds.value(static_cast<int>(entry.key));
+
+		if (valueId != 0)
+		{
+			entry.value = DataValue(newIds.value(static_cast<int>(valueId)));
+		}
+	}
+
+	// Same number of keys, so the index can be refilled where it is.
+	if (m_Index)
+	{
+		for (int count = 0; count < m_IndexSize; count++)
+		{
+			m_Index[count] = 0;
+		}
+
+		for (int count = 0; count < m_Size; count++)
+		{
+			AddToIndex(count);
+		}
+	}
+}
+
+void DataChildren::Rehash(int slotCount)
+{
+	if (!m_Arena)
+	{
+		delete [] m_Index;
+	}
+
+	m_Index = NewIndex(slotCount);
+	m_IndexSize = slotCount;
+
+	for (int count = 0; count < slotCount; count++)
+	{
+		m_Index[count] = 0;
+	}
+
+	for (int count = 0; count < m_Size; count++)
+	{
+		AddToIndex(count);
+	}
+}
+
+void DataChildren::AddToIndex(int entryIndex)
+{
+	uint mask = static_cast<uint>(m_IndexSize - 1);
+	uint slot = Slot(m_Entries[entryIndex].key) & mask;
+
+	while (m_Index[slot] != 0)
+	{
+		slot = (slot + 1) & mask;
+	}
+
+	m_Index[slot] = entryIndex + 1;
+}
+
+DataChildren::Entry* DataChildren::NewEntries(int count)
+{
+	Entry* retval = 0;
+
+	if (m_Arena)
+	{
+		retval = static_cast<Entry*>(m_Arena->Allocate(sizeof(Entry) * count));
+
+		for (int entry = 0; entry < count; entry++)
+		{
+			new (retval + entry) Entry;
+		}
+	}
+	else
+	{
+		retval = new Entry[count];
+	}
+
+	return retval;
+}
+
+int* DataChildren::NewIndex(int count)
+{
+	int* retval = 0;
+
+	if (m_Arena)
+	{
+		retval = static_cast<int*>(m_Arena->Allocate(sizeof(int) * count));
+	}
+	else
+	{
+		retval = new int[count];
+	}
+
+	return retval;
+}
+
+void DataChildren::FreeStorage()
+{
+	// The arena frees its own storage.
+	if (!m_Arena)
+	{
+		if (m_Entries != m_Inline)
+		{
+			delete [] m_Entries;
+		}
+
+		delete [] m_Index;
+	}
+}
+
+DataHierarchy::DataHierarchy(DataArena* arena) : m_Children(arena), m_Lazy(0)
+{
+}
+
+DataHierarchy::~DataHierarchy()
+{
+	if (!Arena())
+	{
+		delete m_Lazy;
+	}
+
+	// The DataValue instances don't delete a struct value, so we have
+	// to do that ourselves.
+	for (int count = 0; count < m_Children.Size(); count++)
+	{
+		const DataValue& child = m_Children.ValueAt(count);
+
+		if (child.IsStruct() && child.StructValue())
+		{
+			Destroy(child.StructValue());
+		}
+	}
+}
+
+DataHierarchy* DataHierarchy::Create(DataArena* arena)
+{
+	DataHierarchy* retval = 0;
+
+	if (arena)
+	{
+		retval = new (arena->Allocate(sizeof(DataHierarchy))) DataHierarchy(arena);
+	}
+	else
+	{
+		retval = new DataHierarchy;
+	}
+
+	return retval;
+}
+
+void DataHierarchy::Destroy(DataHierarchy* hierarchy)
+{
+	// Nodes in an arena go when it does.
+	if (hierarchy && !hierarchy->Arena())
+	{
+		delete hierarchy;
+	}
 }
 
 bool DataHierarchy::Contains(const QString& attrib) const
 {
-	return Contains(qHash(attrib));
+	// Attributes are stored without regard to case, and one that was
+	// never stored can't be here.
+	return Contains(StringDeduplicator::FindNoCase(attrib));
 }
 
-bool DataHierarchy::Contains(uint attribHash) const
+bool DataHierarchy::Contains(uint attribId) const
 {
 	bool retval = false;
 
-	ChildrenMap::const_iterator iter = m_Children.find(attribHash);
+	Materialize();
 
-	if (iter != m_Children.end())
+	if (m_Children.IndexOf(attribId) >= 0)
 	{
 		retval = true;
 	}
@@ -128,17 +406,19 @@ bool DataHierarchy::Contains(uint attribHash) const
 
 DataValue DataHierarchy::Value(const QString& attrib) const
 {
-	return Value(qHash(attrib));
+	return Value(StringDeduplicator::FindNoCase(attrib));
 }
 
-DataValue DataHierarchy::Value(uint attribHash) const
+DataValue DataHierarchy::Value(uint attribId) const
 {
 	DataValue retval;
-	ChildrenMap::const_iterator iter = m_Children.find(attribHash);
 
-	if (iter != m_Children.end())
+	Materialize();
+	int index = m_Children.IndexOf(attribId);
+
+	if (index >= 0)
 	{
-		retval = iter.value();
+		retval = m_Children.ValueAt(index);
 	}
 
 	return retval;
@@ -148,13 +428,15 @@ int DataHierarchy::AllAttributes(QList<uint>& destAttribIds) const
 {
 	int retval = 0;
 
+	Materialize();
+
 	destAttribIds.clear();
-	ChildrenMap::const_iterator iter = m_Children.begin();
+	destAttribIds.reserve(m_Children.Size());
 	
-	while (iter != m_Children.end())
+	// In the order the attributes were first set.
+	while (retval < m_Children.Size())
 	{
-		destAttribIds.push_back(iter.key());
-		iter++;
+		destAttribIds.push_back(m_Children.KeyAt(retval));
 		retval++;
 	}
 
@@ -163,16 +445,25 @@ int DataHierarchy::AllAttributes(QList<uint>& destAttribIds) const
 
 bool DataHierarchy::Set(const QString& attrib, const QString& basicValue)
 {
-	uint attribHash = StringDeduplicator::StoreNoCase(attrib);
-	return Set(attribHash, basicValue);
+	uint attribId = StringDeduplicator::StoreNoCase(attrib);
+	return Set(attribId, basicValue);
 }
 
-bool DataHierarchy::Set(uint attribHash, const QString& basicValue)
+bool DataHierarchy::Set(uint attribId, const QString& basicValue)
 {
-	uint valueId = StringDeduplicator::Store(basicValue);
-	DataValue newChild(valueId);
+	DataValue newChild;
+	qint64 integerValue = 0;
+
+	if (StringUtils::ParseInteger(basicValue, integerValue))
+	{
+		newChild = DataValue::Integer(integerValue);
+	}
+	else
+	{
+		newChild = DataValue(StringDeduplicator::Store(basicValue));
+	}
 	
-	return Set(attribHash, newChild);
+	return Set(attribId, newChild);
 }
 
 bool DataHierarchy::Set(const QString& attrib, DataHierarchy* structValue)
@@ -181,34 +472,189 @@ bool DataHierarchy::Set(const QString& attrib, DataHierarchy* structValue)
 	
 	if (structValue)
 	{
-		uint attribHash = StringDeduplicator::StoreNoCase(attrib);
-		retval = Set(attribHash, structValue);
+		uint attribId = StringDeduplicator::StoreNoCase(attrib);
+		retval = Set(attribId, structValue);
 	}
 
 	return retval;
 }
 
-bool DataHierarchy::Set(uint attribHash, DataHierarchy* structValue)
+bool DataHierarchy::Set(uint attribId, DataHierarchy* structValue)
 {
 	DataValue newChild(structValue);
 	
-	return Set(attribHash, newChild);
+	return Set(attribId, newChild);
 }
 
-bool DataHierarchy::Set(uint attribHash, DataValue val)
+bool DataHierarchy::Set(uint attribId, DataValue val)
 {
 	bool retval = false;
+
+	Materialize();
 	
-	ChildrenMap::iterator iter = m_Children.find(attribHash);
+	int index = m_Children.IndexOf(attribId);
 	
 	// Distinguish between newly-added attributes, and modifications of
 	// existing attributes.
-	if (iter == m_Children.end())
+	if (index < 0)
 	{
+		m_Children.Append(attribId, val);
 		retval = true;
 	}
+	else
+	{
+		m_Children.ValueAt(index) = val;
+	}
 	
-	m_Children.insert(attribHash, val);
-	
 	return retval;
 }
+
+void DataHierarchy::TakeChildren(DataHierarchy* src)
+{
+	if (src && src != this)
+	{
+		Materialize();
+		src->Materialize();
+
+		for (int count = 0; count < src->m_Children.Size(); count++)
+		{
+			Set(src->m_Children.KeyAt(count), src->m_Children.ValueAt(count));
+		}
+
+		// The struct values belong to us now, so src mustn't delete them.
+		src->m_Children.Clear();
+	}
+}
+
+void DataHierarchy::CollectIds(QBitArray& live) const
+{
+	if (!m_Lazy)
+	{
+		for (int count = 0; count < m_Children.Size(); count++)
+		{
+			const DataValue& dval = m_Children.ValueAt(count);
+			uint key = m_Children.KeyAt(count);
+
+			if (key < static_cast<uint>(live.size()))
+			{
+				live.setBit(key);
+			}
+
+			if (dval.IsStruct())
+			{
+				dval.StructValue()->CollectIds(live);
+			}
+			else if (dval.BasicValue() < static_cast<uint>(live.size()))
+			{
+				live.setBit(dval.BasicValue());
+			}
+		}
+	}
+}
+
+void DataHierarchy::RemapIds(const QVector<uint>& newIds)
+{
+	if (!m_Lazy)
+	{
+		m_Children.RemapIds(newIds);
+
+		for (int count = 0; count < m_Children.Size(); count++)
+		{
+			const DataValue& dval = m_Children.ValueAt(count);
+
+			if (dval.IsStruct())
+			{
+				dval.StructValue()->RemapIds(newIds);
+			}
+		}
+	}
+}
+
+void DataHierarchy::SetLazyBody(const QSharedPointer<DataSource>& source,
+	const char* body, qint64 size)
+{
+	DataArena* arena = Arena();
+
+	if (!m_Lazy)
+	{
+		if (arena)
+		{
+			m_Lazy = new (arena->Allocate(sizeof(LazyText))) LazyText;
+		}
+		else
+		{
+			m_Lazy = new LazyText;
+		}
+	}
+
+	m_Lazy->source = source.data();
+	m_Lazy->body = body;
+	m_Lazy->size = size;
+
+	if (arena)
+	{
+		arena->KeepAlive(source);
+	}
+	else
+	{
+		m_Lazy->keepAlive = source;
+	}
+}
+
+const char* DataHierarchy::LazyBody() const
+{
+	const char* retval = 0;
+
+	if (m_Lazy)
+	{
+		retval = m_Lazy->body;
+	}
+
+	return retval;
+}
+
+qint64 DataHierarchy::LazyBodySize() const
+{
+	qint64 retval = 0;
+
+	if (m_Lazy)
+	{
+		retval = m_Lazy->size;
+	}
+
+	return retval;
+}
+
+void DataHierarchy::MaterializeBody() const
+{
+	// Clear this first, so that storing the children doesn't come back here.
+	LazyText* lazy = m_Lazy;
+	m_Lazy = 0;
+
+	DataArena* arena = Arena();
+	QSharedPointer<DataSource> source = arena ? arena->Source(lazy->source) :
+		lazy->keepAlive;
+
+	DataReader reader;
+	DataReader::Error err = reader.ReadLazyBody(const_cast<DataHierarchy*>(this),
+		source, lazy->body, lazy->size);
+
+	// The body was only checked for balanced braces when it was skipped
+	// over, so this is where anything else wrong with it turns up. The
+	// struct is left with what parsed before the error, and its arena is
+	// marked so the file isn't saved without the rest.
+	if (err != DataReader::ERROR_OK)
+	{
+		SystemLogger.NonFatal("Lazily read struct is malformed (error %d)", err);
+
+		if (arena)
+		{
+			arena->Damaged(true);
+		}
+	}
+
+	if (!arena)
+	{
+		delete lazy;
+	}
+}
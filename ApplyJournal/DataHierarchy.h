@@ -10,10 +10,14 @@
 #define DATAHIERARCHY_H
 
 // Library headers.
-#include <QMap>
+#include <QBitArray>
+#include <QSharedPointer>
 #include <QVariant>
+#include <QVector>
 
+class DataArena;
 class DataHierarchy;
+class DataSource;
 
 class DataValue
 {
@@ -21,13 +25,18 @@ public:
 	enum Type {
 		INVALID = 0,
 		STRUCT,
-		BASIC
+		BASIC,
+		INTEGER
 	};
 	
 	DataValue();
 	DataValue(uint basicValue);
 	DataValue(DataHierarchy* structValue);
 
+	// Numbers are kept as they are rather than interned, and only turned
+	// back into text when asked for it.
+	static DataValue Integer(qint64 integerValue);
+
 	// We do a shallow copy on the structure pointer.
 	DataValue(const DataValue& src);
 	DataValue& operator=(const DataValue& src);
@@ -35,49 +44,161 @@ public:
 	~DataValue();
 
 	inline bool IsValid() const { return (IsBasic() || IsStruct()); }
-	inline bool IsBasic() const { return (m_Type == BASIC); }
+	inline bool IsBasic() const { return (m_Type == BASIC || m_Type == INTEGER); }
+	inline bool IsInteger() const { return (m_Type == INTEGER); }
 	inline bool IsStruct() const { return (m_Type == STRUCT); }
 
+	// The interned string's ID, which an integer doesn't have.
 	uint BasicValue() const;
-	const QString& BasicString() const;
+	qint64 IntegerValue() const;
+	QString BasicString() const;
 	DataHierarchy* StructValue() const;
 
 private:
 
 	Type m_Type;
 	uint m_BasicValue;
-	DataHierarchy* m_StructValue;
+
+	// Only one of these is ever used, so they share the space.
+	union Payload {
+		DataHierarchy* structValue;
+		qint64 integerValue;
+	};
+
+	Payload m_Payload;
+};
+
+// A struct's children, kept in the order they were first set. Most structs
+// only have a few, which live inline and are searched in turn; big ones
+// also get an open-addressing index from attribute to position. Anything
+// that doesn't fit inline comes from the arena, if there is one.
+class DataChildren
+{
+public:
+	DataChildren(DataArena* arena);
+	~DataChildren();
+
+	inline int Size() const { return m_Size; }
+	inline bool IsEmpty() const { return (m_Size == 0); }
+	inline DataArena* Arena() const { return m_Arena; }
+
+	inline uint KeyAt(int index) const { return m_Entries[index].key; }
+	inline const DataValue& ValueAt(int index) const { return m_Entries[index].value; }
+	inline DataValue& ValueAt(int index) { return m_Entries[index].value; }
+
+	// Position of the key, or -1 if it isn't here.
+	int IndexOf(uint key) const;
+
+	// The key mustn't be here already.
+	void Append(uint key, const DataValue& value);
+	void Clear();
+
+	// Swap every key and string value for the ID newIds gives it, after the
+	// strings have been compacted.
+	void RemapIds(const QVector<uint>& newIds);
+
+private:
+	DataChildren(const DataChildren& src);
+	DataChildren& operator=(const DataChildren& src);
+
+	static const int INLINE_CHILDREN = 4;
+	static const int INDEX_THRESHOLD = 16;
+
+	// Attribute IDs needn't be well spread, so mix them before masking.
+	static inline uint Slot(uint key) { key *= 0x9E3779B1u; return (key ^ (key >> 16)); }
+
+	void Rehash(int slotCount);
+	void AddToIndex(int entryIndex);
+
+	typedef struct Entry {
+		uint key;
+		DataValue value;
+	} Entry;
+
+	Entry* NewEntries(int count);
+	int* NewIndex(int count);
+	void FreeStorage();
+
+	Entry m_Inline[INLINE_CHILDREN];
+	Entry* m_Entries;
+	int m_Size;
+	int m_Capacity;
+
+	// One more than the entry index in each used slot, and 0 in empty ones.
+	// Not made until there are more than INDEX_THRESHOLD entries.
+	int* m_Index;
+	int m_IndexSize;
+
+	DataArena* m_Arena;
 };
 
 class DataHierarchy
 {
 public:
-	DataHierarchy();
+	// Nodes made with an arena share its lifetime, and so do their struct
+	// values: they're never deleted one at a time, but all freed together
+	// with the arena. Without one, deleting a node deletes its subtree.
+	explicit DataHierarchy(DataArena* arena = 0);
 	~DataHierarchy();
 
-	inline int Children() const { return m_Children.size(); }
+	static DataHierarchy* Create(DataArena* arena);
+	static void Destroy(DataHierarchy* hierarchy);
+
+	inline DataArena* Arena() const { return m_Children.Arena(); }
+
+	inline int Children() const { Materialize(); return m_Children.Size(); }
 	bool Contains(const QString& attrib) const;
-	bool Contains(uint attribHash) const;
+	bool Contains(uint attribId) const;
 
 	DataValue Value(const QString& attrib) const;
-	DataValue Value(uint attribHash) const;
+	DataValue Value(uint attribId) const;
 
 	int AllAttributes(QList<uint>& destAttribIds) const;
 
 	bool Set(const QString& attrib, const QString& basicValue);
-	bool Set(uint attribHash, const QString& basicValue);
+	bool Set(uint attribId, const QString& basicValue);
 	bool Set(const QString& attrib, DataHierarchy* structValue);
-	bool Set(uint attribHash, DataHierarchy* structValue);
+	bool Set(uint attribId, DataHierarchy* structValue);
+	bool Set(uint attribId, DataValue val);
+
+	// Move every child of src here, as if each had been Set in turn, and
+	// leave src empty.
+	void TakeChildren(DataHierarchy* src);
+
+	// Set the bit for every string ID used in this subtree, then move them
+	// all to the IDs StringDeduplicator::Compact gave them. A lazy struct
+	// only holds text, so it uses no IDs and is left alone.
+	void CollectIds(QBitArray& live) const;
+	void RemapIds(const QVector<uint>& newIds);
+
+	// A struct read lazily only keeps the text between its braces, and
+	// parses it the first time anything looks inside. Until then the text
+	// can be written out again as it is.
+	void SetLazyBody(const QSharedPointer<DataSource>& source, const char* body,
+		qint64 size);
+	inline bool IsLazy() const { return (m_Lazy != 0); }
+	const char* LazyBody() const;
+	qint64 LazyBodySize() const;
 	
 private:
 	DataHierarchy(const DataHierarchy& src);
 	DataHierarchy& operator=(const DataHierarchy& src);
 
-	bool Set(uint attribHash, DataValue val);
-
-	typedef QMap<uint,DataValue> ChildrenMap;
+	inline void Materialize() const { if (m_Lazy) { MaterializeBody(); } }
+	void MaterializeBody() const;
+
+	// Only a node on the heap holds on to its source; an arena does that
+	// for the nodes it holds.
+	typedef struct LazyText {
+		DataSource* source;
+		const char* body;
+		qint64 size;
+		QSharedPointer<DataSource> keepAlive;
+	} LazyText;
 	
-	ChildrenMap m_Children;
+	// Both are filled in on first use by the const accessors.
+	mutable DataChildren m_Children;
+	mutable LazyText* m_Lazy;
 };
 
 #endif // DATAHIERARCHY_H
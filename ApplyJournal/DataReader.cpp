@@ -10,15 +10,102 @@
 // Class header, always comes first.
 #include "DataReader.h"
 
+// System headers.
+#include <string.h>
+#if defined(Q_OS_UNIX)
+#include <sys/mman.h>
+#endif
+
 // Library headers.
 #include <QFile>
+#include <QRunnable>
+#include <QThreadPool>
 
 // Common headers.
+#include "DelimiterScanner.h"
+#include "LineReader.h"
+#include "StringDeduplicator.h"
 #include "StringUtils.h"
 
-static const qint64 MAX_LINE_LEN = 50000;
+// Struct bodies are only split if they have at least two pieces this big;
+// anything smaller isn't worth handing to another thread.
+static const qint64 MIN_PARALLEL_CHUNK = 512 * 1024;
+
+// StringUtils::NextTerm takes an int length, so a line longer than this is
+// looked at through a window of it, moved up past each term in turn. Only
+// a single term this long, counting the space before it, is too long.
+static const qint64 MAX_TERM_WINDOW = 0x7fffffff;
 
-DataReader::DataReader() : m_CurrentLine("")
+static bool NextTerm(const char*& line, qint64& length, int& pos,
+	StringUtils::Term& termDest, const char*& termStart, int& termLength)
+{
+	bool retval = true;
+
+	if (length > MAX_TERM_WINDOW)
+	{
+		line += pos;
+		length -= pos;
+		pos = 0;
+	}
+
+	int window = static_cast<int>(qMin(length, MAX_TERM_WINDOW));
+	termDest = StringUtils::NextTerm(line, window, pos, termStart, termLength);
+
+	// Short of the line's end, a term reaching the end of the window may go
+	// on past it. A comment is the rest of the line however long it is.
+	if (window < length && termDest != StringUtils::COMMENT &&
+		(termDest == StringUtils::END_OF_LINE || pos >= window))
+	{
+		retval = false;
+	}
+
+	return retval;
+}
+
+// Parses one piece of a struct body into a hierarchy of its own, which is
+// merged into the real struct once every piece is done. Arenas can't be
+// shared between threads, so each piece gets its own when the reader has
+// one, which the reader's takes over along with the nodes.
+class DataReaderChunk : public QRunnable
+{
+public:
+	DataReaderChunk(const char* data, qint64 size, bool useArena) : m_Data(data),
+		m_Size(size), m_Arena(useArena ? new DataArena : 0),
+		m_Root(DataHierarchy::Create(m_Arena)), m_Error(DataReader::ERROR_OK)
+	{
+		setAutoDelete(false);
+	}
+
+	~DataReaderChunk()
+	{
+		DataHierarchy::Destroy(m_Root);
+		delete m_Arena;
+	}
+
+	virtual void run()
+	{
+		DataReader reader;
+		reader.m_Arena = m_Arena;
+		reader.m_Contexts.push(m_Root);
+		m_Error = reader.ParseBuffer(m_Data, m_Size);
+
+		// The chunk was cut where every struct opened in it is also closed.
+		if (m_Error == DataReader::ERROR_OK && reader.m_Contexts.size() != 1)
+		{
+			m_Error = DataReader::ERROR_CONTEXT_UNDERFLOW;
+		}
+	}
+
+	const char* m_Data;
+	qint64 m_Size;
+	DataArena* m_Arena;
+	DataHierarchy* m_Root;
+	DataReader::Error m_Error;
+};
+
+DataReader::DataReader() : m_ChunkSize(LineReader::DEFAULT_CHUNK_SIZE),
+	m_MaxLineLength(LineReader::DEFAULT_MAX_LINE_LENGTH), m_Threads(1),
+	m_Lazy(false), m_Arena(0), m_SourceEnd(0), m_ResumeAt(0)
 {
 }
 
@@ -27,6 +114,22 @@ DataReader::~DataReader()
 }
 
 DataHierarchy* DataReader::Read(const QString& fileName)
+{
+	DataHierarchy* retval = 0;
+
+	if (m_Lazy)
+	{
+		retval = ReadLazy(fileName);
+	}
+	else
+	{
+		retval = ReadWhole(fileName);
+	}
+
+	return retval;
+}
+
+DataHierarchy* DataReader::ReadWhole(const QString& fileName)
 {
 	DataHierarchy* retval = 0;
 	QFile file(fileName);
@@ -36,29 +139,66 @@ DataHierarchy* DataReader::Read(const QString& fileName)
 		// We're starting a new hierarchy.
 		m_Contexts.clear();
 
-		DataHierarchy* root = new DataHierarchy;
+		DataHierarchy* root = DataHierarchy::Create(m_Arena);
 		m_Contexts.push(root);
 
-		char lineBuffer[MAX_LINE_LEN];
 		Error err = ERROR_OK;
+		qint64 fileSize = file.size();
+		uchar* mapped = 0;
 
-		// Process the file line by line.
-		while (!file.atEnd() && err == ERROR_OK)
+		// Parsing straight from a mapping saves a read and a copy per line.
+		// Anything that can't be mapped, such as an empty file or a pipe, is
+		// read a chunk at a time instead.
+		if (fileSize > 0)
 		{
-			qint64 lineRead = file.readLine(lineBuffer, MAX_LINE_LEN);
+			mapped = file.map(0, fileSize);
+		}
 
-			if (lineRead > 0)
+		if (mapped)
+		{
+#if defined(Q_OS_UNIX)
+			// The file is only ever read once, front to back.
+			madvise(mapped, static_cast<size_t>(fileSize), MADV_SEQUENTIAL);
+#endif
+			if (m_Threads > 1)
 			{
-				QString line(lineBuffer);
-				err = ParseLine(line);
+				err = ParseBufferParallel(reinterpret_cast<const char*>(mapped),
+					fileSize);
 			}
+			else
+			{
+				err = ParseBuffer(reinterpret_cast<const char*>(mapped), fileSize);
+			}
+
+			file.unmap(mapped);
 		}
-		
+		else
+		{
+			LineReader lines(&file, m_ChunkSize, m_MaxLineLength);
+			const char* line = 0;
+			int lineLength = 0;
+
+			// Process the file line by line.
+			while (err == ERROR_OK && lines.NextLine(line, lineLength))
+			{
+				err = ParseLine(line, lineLength);
+			}
+
+			if (err == ERROR_OK && lines.LastError() == LineReader::ERROR_LINE_TOO_LONG)
+			{
+				err = ERROR_LINE_TOO_LONG;
+			}
+			else if (err == ERROR_OK && lines.LastError() != LineReader::ERROR_OK)
+			{
+				err = ERROR_READ_FAILED;
+			}
+		}
+
 		file.close();
 		
 		if (err != ERROR_OK || root->Children() == 0)
 		{
-			delete root;
+			DataHierarchy::Destroy(root);
 		}
 		else
 		{
@@ -69,8 +209,8 @@ DataHierarchy* DataReader::Read(const QString& fileName)
 			else
 			{
 				// Mismatched { and }.
-				// DataHierarchy's destructor deletes all children.
-				delete root;
+				// The children go with the root, or with its arena.
+				DataHierarchy::Destroy(root);
 			}
 		}
 	}
@@ -78,18 +218,354 @@ DataHierarchy* DataReader::Read(const QString& fileName)
 	return retval;
 }
 
-DataReader::Error DataReader::ParseLine(const QString& fileLine)
+DataHierarchy* DataReader::ReadLazy(const QString& fileName)
+{
+	DataHierarchy* retval = 0;
+	QSharedPointer<DataSource> source(new DataSource);
+
+	// Every lazy struct keeps the source alive until it has been parsed.
+	if (source->Open(fileName))
+	{
+		DataHierarchy* root = DataHierarchy::Create(m_Arena);
+		Error err = ReadLazyBody(root, source, source->Data(), source->Size());
+
+		if (err != ERROR_OK || root->Children() == 0)
+		{
+			DataHierarchy::Destroy(root);
+		}
+		else
+		{
+			retval = root;
+		}
+	}
+
+	return retval;
+}
+
+DataReader::Error DataReader::ReadLazyBody(DataHierarchy* dest,
+	const QSharedPointer<DataSource>& source, const char* body, qint64 size)
+{
+	m_Contexts.clear();
+	m_Contexts.push(dest);
+	m_Arena = dest->Arena();
+	m_Source = source;
+	m_SourceEnd = body + size;
+
+	// Structs are never pushed on the stack, as their bodies are skipped,
+	// so the braces balance as long as nothing underflowed.
+	Error retval = ParseBuffer(body, size);
+
+	m_Source.clear();
+	m_SourceEnd = 0;
+	m_Contexts.clear();
+
+	return retval;
+}
+
+DataReader::Error DataReader::ParseBuffer(const char* data, qint64 size)
 {
 	Error retval = ERROR_OK;
-	DataHierarchy* current = m_Contexts.top();
+	const char* pos = data;
+	const char* end = data + size;
+
+	while (pos < end && retval == ERROR_OK)
+	{
+		const char* lineEnd = static_cast<const char*>(memchr(pos, '\n', end - pos));
 
-	m_CurrentLine = fileLine.trimmed();
+		if (!lineEnd)
+		{
+			// The last line doesn't have to be terminated.
+			lineEnd = end;
+		}
+
+		m_ResumeAt = 0;
+		retval = ParseLine(pos, lineEnd - pos);
+
+		if (m_ResumeAt)
+		{
+			// The rest of the line after a skipped struct is parsed as if it
+			// were a line of its own, which is the state it's left in.
+			pos = m_ResumeAt;
+			m_ResumeAt = 0;
+		}
+		else
+		{
+			pos = lineEnd + 1;
+		}
+	}
+
+	return retval;
+}
+
+DataReader::Error DataReader::ParseBufferParallel(const char* data, qint64 size)
+{
+	Error retval = ERROR_OK;
+	const char* parsed = data;
+	const char* pos = data;
+	const char* end = data + size;
+	int depth = 0;
+
+	// The run of lines inside the current top-level struct, where to split
+	// it, and the latest line which starts directly inside the struct.
+	const char* runStart = 0;
+	const char* lastTopLine = 0;
+	QVector<const char*> bounds;
+
+	// Pre-scan a line at a time, only following braces, quotes and
+	// comments, to find the lines which start directly inside a top-level
+	// struct. Every line starts the parser afresh, so the body can be cut
+	// at any of them.
+	while (retval == ERROR_OK && pos < end)
+	{
+		const char* lineEnd = static_cast<const char*>(memchr(pos, '\n', end - pos));
+		const char* next = lineEnd ? lineEnd + 1 : end;
+		int startDepth = depth;
+		int minDepth = depth;
+
+		ScanLine(pos, lineEnd ? lineEnd : end, depth, minDepth);
+
+		if (startDepth == 1 && minDepth >= 1)
+		{
+			if (!runStart)
+			{
+				runStart = pos;
+				bounds.clear();
+				bounds.push_back(pos);
+			}
+			else if (pos - bounds.last() >= MIN_PARALLEL_CHUNK)
+			{
+				bounds.push_back(pos);
+			}
+
+			lastTopLine = pos;
+		}
+		else if (runStart && minDepth < 1)
+		{
+			// This line closes the struct. The run has to stop at a line
+			// starting at the struct's own depth, which is this one unless
+			// the line before it left a nested struct open.
+			const char* runEnd = (startDepth == 1) ? pos : lastTopLine;
+
+			while (!bounds.isEmpty() && bounds.last() >= runEnd)
+			{
+				bounds.removeLast();
+			}
+
+			bounds.push_back(runEnd);
+
+			if (bounds.size() > 2)
+			{
+				retval = ParseBuffer(parsed, runStart - parsed);
+
+				if (retval == ERROR_OK)
+				{
+					retval = ParseChunks(bounds);
+					parsed = runEnd;
+				}
+			}
+
+			runStart = 0;
+		}
+
+		pos = next;
+	}
+
+	if (retval == ERROR_OK && parsed < end)
+	{
+		retval = ParseBuffer(parsed, end - parsed);
+	}
+
+	return retval;
+}
+
+DataReader::Error DataReader::ParseChunks(const QVector<const char*>& bounds)
+{
+	Error retval = ERROR_OK;
+
+	// The pre-scan should have left the parser directly inside a top-level
+	// struct. If the two disagree, parse the run here instead.
+	if (m_Contexts.size() != 2)
+	{
+		retval = ParseBuffer(bounds.first(), bounds.last() - bounds.first());
+	}
+	else
+	{
+		QThreadPool pool;
+		QVector<DataReaderChunk*> chunks;
+
+		pool.setMaxThreadCount(m_Threads);
+
+		for (int count = 0; count + 1 < bounds.size(); count++)
+		{
+			DataReaderChunk* chunk = new DataReaderChunk(bounds[count],
+				bounds[count + 1] - bounds[count], m_Arena != 0);
+			chunks.push_back(chunk);
+			pool.start(chunk);
+		}
+
+		pool.waitForDone();
+
+		// Merge in file order, so an attribute repeated in two chunks ends
+		// up with the later value, as it would on one thread.
+		for (int count = 0; count < chunks.size(); count++)
+		{
+			if (retval == ERROR_OK)
+			{
+				retval = chunks[count]->m_Error;
+			}
+
+			if (retval == ERROR_OK)
+			{
+				m_Contexts.top()->TakeChildren(chunks[count]->m_Root);
+
+				// The chunk's nodes keep pointing at its arena, so the
+				// reader's arena takes it over rather than its blocks.
+				if (m_Arena)
+				{
+					m_Arena->Merge(chunks[count]->m_Arena);
+					chunks[count]->m_Arena = 0;
+				}
+			}
+
+			delete chunks[count];
+		}
+	}
+
+	return retval;
+}
+
+void DataReader::ScanLine(const char* line, const char* end, int& depth,
+	int& minDepth)
+{
+	bool inQuotes = false;
+	bool done = false;
+
+	// Follows the same rules as StringUtils::NextTerm: quotes and escapes
+	// only last until the end of the line, and a comment ends it.
+	while (!done && line < end)
+	{
+		char ch = *line;
+
+		if (inQuotes)
+		{
+			if (ch == '"')
+			{
+				inQuotes = false;
+			}
+			else if (ch == '\\' && (line + 1) < end)
+			{
+				line++;
+			}
+		}
+		else if (ch == '"')
+		{
+			inQuotes = true;
+		}
+		else if (ch == '{')
+		{
+			depth++;
+		}
+		else if (ch == '}')
+		{
+			depth--;
+
+			if (depth < minDepth)
+			{
+				minDepth = depth;
+			}
+		}
+		else if (ch == '#')
+		{
+			done = true;
+		}
+
+		line++;
+	}
+}
+
+const char* DataReader::SkipStruct(const char* body, const char* end)
+{
+	const char* retval = 0;
+	int depth = 1;
+	bool inQuotes = false;
+	bool inComment = false;
+
+	// The same rules as ScanLine, carried on across lines until the brace
+	// which closes the struct.
+	while (!retval && body < end)
+	{
+		char ch = *body;
+
+		if (ch == '\n')
+		{
+			inQuotes = false;
+			inComment = false;
+		}
+		else if (inComment)
+		{
+			// Nothing counts until the end of the line.
+		}
+		else if (inQuotes)
+		{
+			if (ch == '"')
+			{
+				inQuotes = false;
+			}
+			else if (ch == '\\' && (body + 1) < end && body[1] != '\n')
+			{
+				body++;
+			}
+		}
+		else if (ch == '"')
+		{
+			inQuotes = true;
+		}
+		else if (ch == '{')
+		{
+			depth++;
+		}
+		else if (ch == '}')
+		{
+			depth--;
+
+			if (depth == 0)
+			{
+				retval = body;
+			}
+		}
+		else if (ch == '#')
+		{
+			inComment = true;
+		}
+
+		body++;
+	}
+
+	return retval;
+}
+
+DataReader::Error DataReader::ParseLine(const char* line, qint64 length)
+{
+	Error retval = ERROR_OK;
+	DataHierarchy* current = m_Contexts.top();
 	State currState = STATE_CLOSE_OR_ATTRIB;
 
-	QString termStr("");
-	StringUtils::Term currTerm = StringUtils::NextTerm(m_CurrentLine, termStr);
+	// Terms point straight into the line's UTF-8 bytes. Strings are only
+	// made when an attribute and its value are stored.
+	int linePos = 0;
+	const char* termStart = 0;
+	int termLength = 0;
+	StringUtils::Term currTerm = StringUtils::END_OF_LINE;
 	bool done = false;
-	QString attribName("");
+	const char* attribStart = 0;
+	int attribLength = 0;
+	qint64 integerValue = 0;
+
+	if (!NextTerm(line, length, linePos, currTerm, termStart, termLength))
+	{
+		retval = ERROR_LINE_TOO_LONG;
+		done = true;
+	}
 
 	while (!done)
 	{
@@ -113,7 +589,8 @@ DataReader::Error DataReader::ParseLine(const QString& fileLine)
 				}
 				else if (currTerm == StringUtils::ATTRIB_OR_VALUE)
 				{
-					attribName = termStr;
+					attribStart = termStart;
+					attribLength = termLength;
 					currState = STATE_EQUALS;
 				}
 				else if (currTerm == StringUtils::COMMENT ||
@@ -152,15 +629,37 @@ DataReader::Error DataReader::ParseLine(const QString& fileLine)
 				break;
 
 			case STATE_VALUE_OR_OPEN:
-				if (currTerm == StringUtils::ATTRIB_OR_VALUE ||
+				if (currTerm == StringUtils::ATTRIB_OR_VALUE &&
+					StringUtils::ParseInteger(termStart, termLength, integerValue))
+				{
+					// Numbers are common, and never need unquoting or a
+					// string of their own.
+					current->Set(StringDeduplicator::StoreNoCase(attribStart,
+						attribLength), DataValue::Integer(integerValue));
+					currState = STATE_CLOSE_OR_ATTRIB;
+				}
+				else if (currTerm == StringUtils::ATTRIB_OR_VALUE &&
+					DelimiterScanner::NextSpecial(termStart, termStart + termLength) ==
+					termStart + termLength)
+				{
+					// A plain ASCII word is its own value, so its bytes can
+					// be stored as they are.
+					current->Set(StringDeduplicator::StoreNoCase(attribStart,
+						attribLength), DataValue(StringDeduplicator::Store(termStart,
+						termLength)));
+					currState = STATE_CLOSE_OR_ATTRIB;
+				}
+				else if (currTerm == StringUtils::ATTRIB_OR_VALUE ||
 					currTerm == StringUtils::VALUE_ONLY)
 				{
 					QString unquotedTerm("");
-					StringUtils::ValueError verr = StringUtils::UnquoteTerm(termStr, unquotedTerm);
+					StringUtils::ValueError verr = StringUtils::UnquoteTerm(termStart,
+						termLength, unquotedTerm);
 
 					if (verr == StringUtils::VALUE_OK)
 					{
-						current->Set(attribName, unquotedTerm);
+						current->Set(StringDeduplicator::StoreNoCase(attribStart,
+							attribLength), unquotedTerm);
 						currState = STATE_CLOSE_OR_ATTRIB;
 					}
 					else
@@ -174,11 +673,34 @@ DataReader::Error DataReader::ParseLine(const QString& fileLine)
 					// This attribute is a structure rather than a simple
 					// value, so it needs to be added to the context stack
 					// as well as set as a property in its parent.
-					DataHierarchy* newStruct = new DataHierarchy;
-					current->Set(attribName, newStruct);
-					m_Contexts.push(newStruct);
-					current = m_Contexts.top();
-					currState = STATE_CLOSE_OR_ATTRIB;
+					DataHierarchy* newStruct = DataHierarchy::Create(m_Arena);
+					current->Set(StringDeduplicator::StoreNoCase(attribStart,
+						attribLength), newStruct);
+
+					if (!m_Source.isNull())
+					{
+						// Keep the body's text and carry on after it.
+						const char* body = line + linePos;
+						const char* close = SkipStruct(body, m_SourceEnd);
+
+						if (close)
+						{
+							newStruct->SetLazyBody(m_Source, body, close - body);
+							m_ResumeAt = close + 1;
+						}
+						else
+						{
+							retval = ERROR_UNCLOSED_STRUCT;
+						}
+
+						done = true;
+					}
+					else
+					{
+						m_Contexts.push(newStruct);
+						current = m_Contexts.top();
+						currState = STATE_CLOSE_OR_ATTRIB;
+					}
 				}
 				else
 				{
@@ -194,9 +716,11 @@ DataReader::Error DataReader::ParseLine(const QString& fileLine)
 				break;
 		}
 
-		if (!done)
+		if (!done && !NextTerm(line, length, linePos, currTerm, termStart,
+			termLength))
 		{
-			currTerm = StringUtils::NextTerm(m_CurrentLine, termStr);
+			retval = ERROR_LINE_TOO_LONG;
+			done = true;
 		}
 	}
 
@@ -11,10 +11,14 @@
 #define DATAREADER_H
 
 // Library headers.
+#include <QSharedPointer>
 #include <QStack>
+#include <QVector>
 
 // Application headers.
+#include "DataArena.h"
 #include "DataHierarchy.h"
+#include "DataSource.h"
 
 class DataReader
 {
@@ -27,7 +31,10 @@ public:
 		ERROR_MISSING_ATTRIBUTE,
 		ERROR_NO_EQUALS,
 		ERROR_CONTEXT_UNDERFLOW,
-		ERROR_UNKNOWN_TERM
+		ERROR_UNKNOWN_TERM,
+		ERROR_LINE_TOO_LONG,
+		ERROR_UNCLOSED_STRUCT,
+		ERROR_READ_FAILED
 	};
 
 	enum State {
@@ -39,16 +46,68 @@ public:
 	DataReader();
 	~DataReader();
 
+	// Buffering for files which can't be memory mapped; see LineReader.
+	inline void ChunkSize(int newSize) { m_ChunkSize = newSize; }
+	inline int ChunkSize() const { return m_ChunkSize; }
+
+	inline void MaxLineLength(int newLength) { m_MaxLineLength = newLength; }
+	inline int MaxLineLength() const { return m_MaxLineLength; }
+
+	// More than one thread splits the body of any large top-level struct,
+	// such as a layer's cells, into runs of whole lines and parses them in
+	// parallel. The result is the same as parsing on one thread.
+	inline void Threads(int newThreads) { m_Threads = newThreads; }
+	inline int Threads() const { return m_Threads; }
+
+	// Lazy reading keeps the whole file in memory and skips over the body
+	// of every struct, which is only parsed when something first looks
+	// inside it. Errors inside a skipped body are reported then, rather
+	// than by Read.
+	inline void Lazy(bool newLazy) { m_Lazy = newLazy; }
+	inline bool Lazy() const { return m_Lazy; }
+
+	// Every node read is allocated from the arena, if there is one, and the
+	// hierarchy then lasts exactly as long as it does.
+	inline void Arena(DataArena* newArena) { m_Arena = newArena; }
+	inline DataArena* Arena() const { return m_Arena; }
+
 	DataHierarchy* Read(const QString& fileName);
 
+	// Parse the text of a lazily read struct's body into dest, using dest's
+	// arena. Any structs inside it are left lazy in turn.
+	Error ReadLazyBody(DataHierarchy* dest, const QSharedPointer<DataSource>& source,
+		const char* body, qint64 size);
+
 private:
 	DataReader(const DataReader& src);
 	DataReader& operator=(const DataReader& src);
 
-	Error ParseLine(const QString& line);
+	friend class DataReaderChunk;
+
+	Error ParseBuffer(const char* data, qint64 size);
+	Error ParseBufferParallel(const char* data, qint64 size);
+	Error ParseChunks(const QVector<const char*>& bounds);
+	Error ParseLine(const char* line, qint64 length);
+
+	DataHierarchy* ReadWhole(const QString& fileName);
+	DataHierarchy* ReadLazy(const QString& fileName);
+
+	static void ScanLine(const char* line, const char* end, int& depth,
+		int& minDepth);
+	static const char* SkipStruct(const char* body, const char* end);
 
 	QStack<DataHierarchy*> m_Contexts;
-	QString m_CurrentLine;
+	int m_ChunkSize;
+	int m_MaxLineLength;
+	int m_Threads;
+	bool m_Lazy;
+	DataArena* m_Arena;
+
+	// Only set while reading lazily. A skipped struct body can end on a
+	// later line, so parsing picks up again from m_ResumeAt.
+	QSharedPointer<DataSource> m_Source;
+	const char* m_SourceEnd;
+	const char* m_ResumeAt;
 };
 
 #endif // DATAREADER_H
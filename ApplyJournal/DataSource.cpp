@@ -0,0 +1,65 @@
+//
+// DataSource.cpp
+//
+// Hold the contents of a data file in memory, mapped where possible, for as
+// long as anything still refers to its text.
+//
+// (c) 2014 Graham West
+
+// Class header, always comes first.
+#include "DataSource.h"
+
+DataSource::DataSource() : m_Mapped(0), m_Data(0), m_Size(0)
+{
+}
+
+DataSource::~DataSource()
+{
+	if (m_Mapped)
+	{
+		m_File.unmap(m_Mapped);
+	}
+
+	if (m_File.isOpen())
+	{
+		m_File.close();
+	}
+}
+
+bool DataSource::Open(const QString& fileName)
+{
+	bool retval = false;
+
+	if (!m_Data)
+	{
+		m_File.setFileName(fileName);
+
+		if (m_File.exists() && m_File.open(QIODevice::ReadOnly))
+		{
+			qint64 fileSize = m_File.size();
+
+			if (fileSize > 0)
+			{
+				m_Mapped = m_File.map(0, fileSize);
+			}
+
+			if (m_Mapped)
+			{
+				m_Data = reinterpret_cast<const char*>(m_Mapped);
+				m_Size = fileSize;
+			}
+			else
+			{
+				// Not everything can be mapped, so fall back on a copy.
+				m_Contents = m_File.readAll();
+				m_File.close();
+				m_Data = m_Contents.constData();
+				m_Size = m_Contents.size();
+			}
+
+			retval = true;
+		}
+	}
+
+	return retval;
+}
@@ -0,0 +1,40 @@
+//
+// DataSource.h
+//
+// Hold the contents of a data file in memory, mapped where possible, for as
+// long as anything still refers to its text.
+//
+// (c) 2014 Graham West
+
+#if !defined(DATASOURCE_H)
+#define DATASOURCE_H
+
+// Library headers.
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+
+class DataSource
+{
+public:
+	DataSource();
+	~DataSource();
+
+	bool Open(const QString& fileName);
+
+	inline const char* Data() const { return m_Data; }
+	inline qint64 Size() const { return m_Size; }
+
+private:
+	DataSource(const DataSource& src);
+	DataSource& operator=(const DataSource& src);
+
+	QFile m_File;
+	uchar* m_Mapped;
+	QByteArray m_Contents;
+
+	const char* m_Data;
+	qint64 m_Size;
+};
+
+#endif // DATASOURCE_H
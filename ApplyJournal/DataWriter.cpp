@@ -69,10 +69,19 @@ bool DataWriter::WriteHierarchy(QTextStream& stream,
 
 		while (retval && count < attribIds.size())
 		{
-			const QString& attribName = StringDeduplicator::Retrieve(attribIds[count]);
+			QString attribName = StringDeduplicator::Retrieve(attribIds[count]).ToString();
 			DataValue dval = hierarchy->Value(attribIds[count]);
 
-			if (dval.IsBasic())
+			if (dval.IsInteger())
+			{
+				// A number never needs quoting, nor a string lookup.
+				Indent(stream, depth * m_Indent);
+				stream << attribName;
+				stream << " = ";
+				stream << dval.IntegerValue();
+				stream << "\n";
+			}
+			else if (dval.IsBasic())
 			{
 				const QString& valueStr = dval.BasicString();
 
@@ -82,6 +91,19 @@ bool DataWriter::WriteHierarchy(QTextStream& stream,
 				stream << StringUtils::QuoteTerm(valueStr);
 				stream << "\n";
 			}
+			else if (dval.IsStruct() && dval.StructValue()->IsLazy())
+			{
+				// Nothing has looked inside this struct since it was read,
+				// so its text can go back out just as it came in.
+				const DataHierarchy* lazy = dval.StructValue();
+
+				Indent(stream, depth * m_Indent);
+				stream << attribName;
+				stream << " = {";
+				stream << QString::fromUtf8(lazy->LazyBody(),
+					static_cast<int>(lazy->LazyBodySize()));
+				stream << "}\n";
+			}
 			else if (dval.IsStruct())
 			{
 				Indent(stream, depth * m_Indent);
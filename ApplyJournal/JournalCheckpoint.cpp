@@ -0,0 +1,159 @@
+//
+// JournalCheckpoint.h
+//
+// Remember how far through a journal has been applied, so replaying it
+// again can start from there rather than from the beginning.
+//
+// (c) 2014 Graham West
+
+// Class header, always comes first.
+#include "JournalCheckpoint.h"
+
+// System headers.
+#include <string.h>
+
+// Library headers.
+#include <QByteArray>
+#include <QFile>
+#include <QtEndian>
+
+// Common headers.
+#include "Checksum.h"
+
+const char JournalCheckpoint::MAGIC[4] = { 'C', 'C', 'J', 'C' };
+
+JournalCheckpoint::JournalCheckpoint()
+{
+	Clear();
+}
+
+JournalCheckpoint::~JournalCheckpoint()
+{
+}
+
+void JournalCheckpoint::Clear()
+{
+	m_HeadLength = 0;
+	m_HeadChecksum = 0;
+	m_LineStart = 0;
+	m_Offset = 0;
+	m_Line = 0;
+	m_LineChecksum = 0;
+}
+
+void JournalCheckpoint::Start(qint64 offset)
+{
+	m_LineStart = offset;
+	m_Offset = offset;
+}
+
+bool JournalCheckpoint::ReadHead(QIODevice* device)
+{
+	int length = static_cast<int>(qMin<qint64>(device->size(), HEAD_SIZE));
+	bool retval = HeadChecksum(device, length, m_HeadChecksum);
+
+	m_HeadLength = retval ? length : 0;
+
+	return retval;
+}
+
+bool JournalCheckpoint::HeadMatches(QIODevice* device) const
+{
+	quint32 checksum = 0;
+
+	// A journal shorter than the checkpoint can't be the one it was made
+	// from, even if it starts the same way.
+	return (device->size() >= m_Offset &&
+		HeadChecksum(device, m_HeadLength, checksum) && checksum == m_HeadChecksum);
+}
+
+void JournalCheckpoint::Advance(qint64 end, quint32 checksum)
+{
+	m_LineStart = m_Offset;
+	m_Offset = end;
+	m_Line++;
+	m_LineChecksum = checksum;
+}
+
+bool JournalCheckpoint::Read(const QString& fileName)
+{
+	bool retval = false;
+	QFile file(fileName);
+
+	if (file.open(QIODevice::ReadOnly))
+	{
+		QByteArray contents = file.read(FILE_SIZE + 1);
+		const uchar* data = reinterpret_cast<const uchar*>(contents.constData());
+		int crcOffset = FILE_SIZE - sizeof(quint32);
+
+		if (contents.size() == FILE_SIZE &&
+			memcmp(data, MAGIC, sizeof(MAGIC)) == 0 &&
+			qFromLittleEndian<quint32>(data + 4) == VERSION &&
+			qFromLittleEndian<quint32>(data + crcOffset) ==
+				Checksum::Crc32c(contents.constData(), crcOffset))
+		{
+			m_HeadLength = qFromLittleEndian<quint32>(data + 8);
+			m_HeadChecksum = qFromLittleEndian<quint32>(data + 12);
+			m_LineStart = qFromLittleEndian<qint64>(data + 16);
+			m_Offset = qFromLittleEndian<qint64>(data + 24);
+			m_Line = qFromLittleEndian<quint32>(data + 32);
+			m_LineChecksum = qFromLittleEndian<quint32>(data + 36);
+
+			retval = (m_HeadLength >= 0 && m_HeadLength <= HEAD_SIZE &&
+				m_LineStart >= 0 && m_LineStart <= m_Offset);
+		}
+
+		file.close();
+	}
+
+	if (!retval)
+	{
+		Clear();
+	}
+
+	return retval;
+}
+
+bool JournalCheckpoint::Write(const QString& fileName) const
+{
+	bool retval = false;
+	uchar data[FILE_SIZE];
+	int crcOffset = FILE_SIZE - sizeof(quint32);
+
+	memcpy(data, MAGIC, sizeof(MAGIC));
+	qToLittleEndian<quint32>(VERSION, data + 4);
+	qToLittleEndian<quint32>(m_HeadLength, data + 8);
+	qToLittleEndian<quint32>(m_HeadChecksum, data + 12);
+	qToLittleEndian<qint64>(m_LineStart, data + 16);
+	qToLittleEndian<qint64>(m_Offset, data + 24);
+	qToLittleEndian<quint32>(m_Line, data + 32);
+	qToLittleEndian<quint32>(m_LineChecksum, data + 36);
+	qToLittleEndian<quint32>(Checksum::Crc32c(reinterpret_cast<const char*>(data),
+		crcOffset), data + crcOffset);
+
+	QFile file(fileName);
+
+	if (file.open(QIODevice::WriteOnly))
+	{
+		retval = (file.write(reinterpret_cast<const char*>(data), FILE_SIZE) == FILE_SIZE);
+		file.close();
+	}
+
+	return retval;
+}
+
+bool JournalCheckpoint::HeadChecksum(QIODevice* device, int length,
+	quint32& checksumDest)
+{
+	bool retval = false;
+	char head[HEAD_SIZE];
+
+	// Peeking leaves the device where it was.
+	if (length >= 0 && length <= HEAD_SIZE && device->peek(head, length) == length)
+	{
+		checksumDest = Checksum::Crc32c(head, length);
+		retval = true;
+	}
+
+	return retval;
+}
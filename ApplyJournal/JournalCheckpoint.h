@@ -0,0 +1,80 @@
+//
+// JournalCheckpoint.h
+//
+// Remember how far through a journal has been applied, so replaying it
+// again can start from there rather than from the beginning.
+//
+// (c) 2014 Graham West
+
+#if !defined(JOURNALCHECKPOINT_H)
+#define JOURNALCHECKPOINT_H
+
+// Library headers.
+#include <QIODevice>
+#include <QString>
+
+// A checkpoint names its journal by a checksum of the journal's first few
+// bytes, which appending to the journal leaves alone, and ends at the last
+// line applied, whose own checksum is kept so the line can be checked
+// again before carrying on after it. In a binary journal, records stand in
+// for lines.
+class JournalCheckpoint
+{
+public:
+	// How much of the start of the journal identifies it.
+	static const int HEAD_SIZE = 4096;
+
+	JournalCheckpoint();
+	~JournalCheckpoint();
+
+	// Plain values, so copies are made member by member.
+
+	inline int HeadLength() const { return m_HeadLength; }
+	inline quint32 HeadChecksum() const { return m_HeadChecksum; }
+
+	// The last line applied starts at LineStart and ends, including its
+	// newline, at Offset, which is where the next line starts.
+	inline qint64 LineStart() const { return m_LineStart; }
+	inline qint64 Offset() const { return m_Offset; }
+	inline unsigned int Line() const { return m_Line; }
+	inline quint32 LineChecksum() const { return m_LineChecksum; }
+
+	// Nothing applied yet, from a journal not yet seen.
+	inline bool IsEmpty() const { return (m_Line == 0); }
+
+	void Clear();
+
+	// Before anything is applied, say where the first line starts, if the
+	// journal has a header before it.
+	void Start(qint64 offset);
+
+	// Take the identity of the journal at the start of device, which must
+	// be open and at its start.
+	bool ReadHead(QIODevice* device);
+	bool HeadMatches(QIODevice* device) const;
+
+	// Another line has been applied, ending at end.
+	void Advance(qint64 end, quint32 checksum);
+
+	bool Read(const QString& fileName);
+	bool Write(const QString& fileName) const;
+
+private:
+	static const char MAGIC[4];
+	static const quint32 VERSION = 1;
+
+	// Magic, version, the fields, then a CRC-32C of all of those.
+	static const int FILE_SIZE = 2 * sizeof(quint32) + 4 * sizeof(quint32) +
+		2 * sizeof(qint64) + sizeof(quint32);
+
+	static bool HeadChecksum(QIODevice* device, int length, quint32& checksumDest);
+
+	int m_HeadLength;
+	quint32 m_HeadChecksum;
+	qint64 m_LineStart;
+	qint64 m_Offset;
+	unsigned int m_Line;
+	quint32 m_LineChecksum;
+};
+
+#endif // JOURNALCHECKPOINT_H
@@ -0,0 +1,180 @@
+//
+// JournalCompactor.h
+//
+// Gather a window of journal lines and drop every update that a later one
+// in the window overwrites, so each attribute is only set once.
+//
+// (c) 2014 Graham West
+
+// Class header, always comes first.
+#include "JournalCompactor.h"
+
+JournalCompactor::JournalCompactor()
+{
+	Reset();
+}
+
+JournalCompactor::~JournalCompactor()
+{
+}
+
+bool JournalCompactor::Add(const JournalParser::ParsedLine& line, qint64 end)
+{
+	bool retval = true;
+
+	// Mark out how the line uses each path first, so a conflict can be
+	// undone before anything else has changed.
+	m_Marked.clear();
+	m_Leaves.clear();
+
+	for (int count = 0; retval && count < line.updates.size(); count++)
+	{
+		const JournalParser::ParsedUpdate& update = line.updates[count];
+		int node = Child(0, update.fileId);
+
+		for (int attrib = 0; retval && attrib < update.attribs.size(); attrib++)
+		{
+			Kind wanted = (attrib + 1 < update.attribs.size()) ? KIND_STRUCT : KIND_BASIC;
+			node = Child(node, update.attribs[attrib]);
+
+			if (m_Nodes[node].kind == KIND_UNKNOWN)
+			{
+				m_Nodes[node].kind = wanted;
+				m_Marked.push_back(node);
+			}
+			else if (m_Nodes[node].kind != wanted)
+			{
+				retval = false;
+			}
+		}
+
+		m_Leaves.push_back(node);
+	}
+
+	if (!retval)
+	{
+		for (int count = 0; count < m_Marked.size(); count++)
+		{
+			m_Nodes[m_Marked[count]].kind = KIND_UNKNOWN;
+		}
+	}
+	else
+	{
+		// The last write to each path is the only one kept, which within a
+		// line is the same rule as applying it.
+		m_FirstWrites.push_back(m_Writes.size());
+
+		for (int count = 0; count < line.updates.size(); count++)
+		{
+			Node& leaf = m_Nodes[m_Leaves[count]];
+
+			if (leaf.lastWrite >= 0)
+			{
+				m_Writes[leaf.lastWrite].live = false;
+				m_Dropped++;
+			}
+
+			Write write;
+			write.node = m_Leaves[count];
+			write.live = true;
+
+			leaf.lastWrite = m_Writes.size();
+			m_Writes.push_back(write);
+		}
+
+		m_Lines.push_back(line);
+		m_Ends.push_back(end);
+	}
+
+	return retval;
+}
+
+void JournalCompactor::Merged(JournalParser::ParsedLine& lineDest) const
+{
+	lineDest.updates.clear();
+	lineDest.checksum = 0;
+	lineDest.error = JournalParser::ERROR_OK;
+
+	for (int line = 0; line < m_Lines.size(); line++)
+	{
+		const QVector<JournalParser::ParsedUpdate>& updates = m_Lines[line].updates;
+
+		for (int count = 0; count < updates.size(); count++)
+		{
+			if (m_Writes[m_FirstWrites[line] + count].live)
+			{
+				lineDest.updates.push_back(updates[count]);
+			}
+		}
+	}
+}
+
+void JournalCompactor::Compacted(int index, JournalParser::ParsedLine& lineDest) const
+{
+	const JournalParser::ParsedLine& line = m_Lines[index];
+
+	lineDest.updates.clear();
+	lineDest.checksum = line.checksum;
+	lineDest.error = line.error;
+
+	for (int count = 0; count < line.updates.size(); count++)
+	{
+		if (m_Writes[m_FirstWrites[index] + count].live)
+		{
+			lineDest.updates.push_back(line.updates[count]);
+		}
+	}
+}
+
+void JournalCompactor::Flush()
+{
+	for (int count = 0; count < m_Writes.size(); count++)
+	{
+		m_Nodes[m_Writes[count].node].lastWrite = -1;
+	}
+
+	m_Lines.clear();
+	m_Ends.clear();
+	m_FirstWrites.clear();
+	m_Writes.clear();
+}
+
+void JournalCompactor::Reset()
+{
+	Node top;
+	top.kind = KIND_STRUCT;
+	top.lastWrite = -1;
+
+	m_Nodes.clear();
+	m_Nodes.push_back(top);
+	m_Children.clear();
+	m_Lines.clear();
+	m_Ends.clear();
+	m_FirstWrites.clear();
+	m_Writes.clear();
+	m_Dropped = 0;
+}
+
+int JournalCompactor::Child(int parent, uint key)
+{
+	quint64 childKey = (static_cast<quint64>(parent) << 32) | key;
+	QHash<quint64, int>::const_iterator iter = m_Children.find(childKey);
+	int retval = 0;
+
+	if (iter != m_Children.end())
+	{
+		retval = iter.value();
+	}
+	else
+	{
+		Node child;
+		child.kind = KIND_UNKNOWN;
+		child.lastWrite = -1;
+
+		retval = m_Nodes.size();
+		m_Nodes.push_back(child);
+		m_Children.insert(childKey, retval);
+	}
+
+	return retval;
+}
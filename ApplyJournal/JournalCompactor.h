@@ -0,0 +1,94 @@
+//
+// JournalCompactor.h
+//
+// Gather a window of journal lines and drop every update that a later one
+// in the window overwrites, so each attribute is only set once.
+//
+// (c) 2014 Graham West
+
+#if !defined(JOURNALCOMPACTOR_H)
+#define JOURNALCOMPACTOR_H
+
+// Library headers.
+#include <QHash>
+#include <QVector>
+
+// Application headers.
+#include "JournalParser.h"
+
+// Every path a line sets ends in a basic value and runs through structs,
+// and a journal can never turn one into the other. So once a path has been
+// used one way it can only ever be used that way, and a line that uses it
+// the other way would fail however the lines before it were applied. Such
+// a line isn't taken into the window, which leaves the lines before it to
+// be applied first, and it on its own after them.
+//
+// Which way each path has been used is remembered until Reset, not just for
+// the window, since without the data files that's all there is to go on.
+class JournalCompactor
+{
+public:
+	JournalCompactor();
+	~JournalCompactor();
+
+	inline int Lines() const { return m_Lines.size(); }
+	inline bool IsEmpty() const { return m_Lines.isEmpty(); }
+	inline const JournalParser::ParsedLine& Line(int index) const { return m_Lines[index]; }
+	inline qint64 LineEnd(int index) const { return m_Ends[index]; }
+
+	// Updates dropped since Reset, because a later one overwrote them.
+	inline qint64 Dropped() const { return m_Dropped; }
+
+	// Returns false, leaving the window as it was, if the line uses a path
+	// the other way from how it has been used before.
+	bool Add(const JournalParser::ParsedLine& line, qint64 end);
+
+	// All the window's updates that are still needed, in order, as one line.
+	void Merged(JournalParser::ParsedLine& lineDest) const;
+
+	// One line of the window with only the updates still needed.
+	void Compacted(int index, JournalParser::ParsedLine& lineDest) const;
+
+	// Empty the window, but remember how paths have been used.
+	void Flush();
+	void Reset();
+
+private:
+	JournalCompactor(const JournalCompactor& src);
+	JournalCompactor& operator=(const JournalCompactor& src);
+
+	enum Kind {
+		KIND_UNKNOWN = 0,
+		KIND_STRUCT,
+		KIND_BASIC
+	};
+
+	// Paths are kept as a tree. Node 0 is above the files, whose nodes are
+	// found by file ID, and every other node by its parent and attribute.
+	typedef struct Node {
+		Kind kind;
+		int lastWrite;
+	} Node;
+
+	// Whether a write in the window is still needed, and the path it was
+	// to. Writes are kept in line order, each line's together.
+	typedef struct Write {
+		int node;
+		bool live;
+	} Write;
+
+	int Child(int parent, uint key);
+
+	QVector<Node> m_Nodes;
+	QHash<quint64, int> m_Children;
+
+	QVector<JournalParser::ParsedLine> m_Lines;
+	QVector<qint64> m_Ends;
+	QVector<int> m_FirstWrites;
+	QVector<Write> m_Writes;
+	QVector<int> m_Marked;
+	QVector<int> m_Leaves;
+	qint64 m_Dropped;
+};
+
+#endif // JOURNALCOMPACTOR_H
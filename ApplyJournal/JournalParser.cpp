@@ -2,70 +2,323 @@
 // JournalParser.cpp
 //
 // Read a journal file and apply updates to the data files, checking each
-// transaction's integrity.
+// transaction's integrity. Journals are either text or the binary format
+// described in BinaryJournal.h, which is told apart by its magic.
 //
 // (c) 2014 Graham West
 
 // Class header, always comes first.
 #include "JournalParser.h"
 
+// System headers.
+#include <string.h>
+#include <algorithm>
+
 // Library headers.
+#include <QAtomicInt>
 #include <QByteArray>
 #include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QQueue>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <QtEndian>
 
 // Common headers.
+#include "Checksum.h"
+#include "ErrorLogger.h"
+#include "LineReader.h"
 #include "StringDeduplicator.h"
 #include "StringUtils.h"
 
-static const qint64 MAX_LINE_LEN = 50000;
+// Application headers.
+#include "BinaryJournal.h"
+#include "JournalCompactor.h"
+#include "JournalWriter.h"
+
+// Lines read from the journal, to be checksummed and tokenized by a worker
+// and then applied, in order, by the thread that called Process.
+class JournalBatch : public QRunnable
+{
+public:
+	JournalBatch(const JournalParser* parser) : m_Parser(parser), m_Done(0)
+	{
+		setAutoDelete(false);
+	}
+
+	virtual void run()
+	{
+		int start = 0;
+
+		m_Lines.resize(m_Ends.size());
+
+		for (int count = 0; count < m_Ends.size(); count++)
+		{
+			m_Lines[count].error = m_Parser->TokenizeLine(m_Text.constData() + start,
+				m_Ends[count] - start, m_Lines[count]);
+
+			start = m_Ends[count];
+		}
+
+		m_Done.release();
+	}
+
+	const JournalParser* m_Parser;
+	QByteArray m_Text;
+	QVector<int> m_Ends;
+
+	// Where each line ends in the journal, for the checkpoint.
+	QVector<qint64> m_Offsets;
+	QVector<JournalParser::ParsedLine> m_Lines;
+	QSemaphore m_Done;
+};
+
+// Reads the journal on a thread of its own, a batch of lines at a time,
+// starting a worker on each batch and queueing it for the applier. Only so
+// many batches can be waiting to be applied at once, so reading never gets
+// far ahead of applying.
+class JournalFeeder : public QRunnable
+{
+public:
+	JournalFeeder(const JournalParser* parser, LineReader* lines, QThreadPool* pool,
+		int maxBatches) : m_Parser(parser), m_Reader(lines), m_Pool(pool),
+		m_Free(maxBatches), m_Abort(0)
+	{
+		setAutoDelete(false);
+	}
+
+	virtual void run()
+	{
+		JournalBatch* batch = 0;
+
+		do
+		{
+			const char* lineData = 0;
+			int lineLength = 0;
+
+			m_Free.acquire();
+			batch = 0;
+
+			if (m_Abort.loadAcquire() == 0)
+			{
+				batch = new JournalBatch(m_Parser);
+
+				while (batch->m_Ends.size() < JournalParser::BATCH_LINES &&
+					m_Reader->NextLine(lineData, lineLength) &&
+					(m_Reader->Terminated() || !m_Parser->m_CompleteLinesOnly))
+				{
+					batch->m_Text.append(lineData, lineLength);
+					batch->m_Ends.push_back(batch->m_Text.size());
+					batch->m_Offsets.push_back(m_Reader->Position());
+				}
+
+				if (batch->m_Ends.isEmpty())
+				{
+					delete batch;
+					batch = 0;
+				}
+				else
+				{
+					m_Pool->start(batch);
+				}
+			}
+
+			// No batch tells the applier there are no more.
+			QMutexLocker locker(&m_Lock);
+			m_Queue.enqueue(batch);
+			m_Ready.wakeOne();
+		}
+		while (batch);
+	}
+
+	JournalBatch* Pop()
+	{
+		QMutexLocker locker(&m_Lock);
+
+		while (m_Queue.isEmpty())
+		{
+			m_Ready.wait(&m_Lock);
+		}
+
+		return m_Queue.dequeue();
+	}
+
+	inline void Release() { m_Free.release(); }
+	inline void Abort() { m_Abort.storeRelease(1); }
+
+private:
+	const JournalParser* m_Parser;
+	LineReader* m_Reader;
+	QThreadPool* m_Pool;
+
+	QMutex m_Lock;
+	QWaitCondition m_Ready;
+	QQueue<JournalBatch*> m_Queue;
+	QSemaphore m_Free;
+	QAtomicInt m_Abort;
+};
 
 JournalParser::JournalParser(const QString& fileName, DataFileTracker* tracker,
 	bool fixChecksums) :
 		m_FileName(fileName), m_FileTracker(tracker), m_FixChecksums(fixChecksums),
-		m_LinesRead(0)
+		m_ChunkSize(LineReader::DEFAULT_CHUNK_SIZE),
+		m_MaxLineLength(LineReader::DEFAULT_MAX_LINE_LENGTH), m_Threads(1),
+		m_CompleteLinesOnly(false), m_CompactWindow(1), m_LinesRead(0),
+		m_LinesApplied(0), m_Output(0), m_Compactor(new JournalCompactor),
+		m_UpdateCount(0)
 {
 }
 
 JournalParser::~JournalParser()
 {
+	delete m_Compactor;
 }
 
 bool JournalParser::Process()
+{
+	bool retval = false;
+
+	if (m_FileTracker)
+	{
+		retval = Run();
+	}
+
+	return retval;
+}
+
+bool JournalParser::Convert(JournalWriter& output)
+{
+	m_Output = &output;
+	bool retval = Run();
+	m_Output = 0;
+
+	return retval;
+}
+
+bool JournalParser::IsBinary(const QString& fileName)
+{
+	bool retval = false;
+	QFile file(fileName);
+
+	if (file.open(QIODevice::ReadOnly))
+	{
+		char magic[sizeof(BinaryJournal::MAGIC)];
+
+		if (file.read(magic, sizeof(magic)) == sizeof(magic) &&
+			memcmp(magic, BinaryJournal::MAGIC, sizeof(magic)) == 0)
+		{
+			retval = true;
+		}
+
+		file.close();
+	}
+
+	return retval;
+}
+
+bool JournalParser::Run()
 {
 	bool retval = false;
 	QFile file(m_FileName);
 	
-	if (m_FileTracker && file.exists() && file.open(QIODevice::ReadOnly))
+	if (file.exists() && file.open(QIODevice::ReadOnly))
 	{
-		char lineBuffer[MAX_LINE_LEN];
+		char magic[sizeof(BinaryJournal::MAGIC)];
+		bool binary = (file.peek(magic, sizeof(magic)) == sizeof(magic) &&
+			memcmp(magic, BinaryJournal::MAGIC, sizeof(magic)) == 0);
+		bool resume = false;
+		LineReader::Error readErr = LineReader::ERROR_OK;
 		Error err = ERROR_OK;
 
-		// We might be reprocessing the file.
+		// We might be reprocessing the file, with different files loaded.
 		m_LinesRead = 0;
+		m_LinesApplied = 0;
+		m_FileRoots.clear();
+		m_PathCache.Clear();
+		m_Compactor->Reset();
 
-		// Process the file line by line.
-		while (!file.atEnd() && err == ERROR_OK)
+		// A journal that has been replaced since its checkpoint was made is
+		// a different journal, and all of it is new.
+		if (!m_Resume.IsEmpty())
 		{
-			qint64 lineRead = file.readLine(lineBuffer, MAX_LINE_LEN);
-			m_LinesRead++;
+			resume = m_Resume.HeadMatches(&file);
+
+			if (!resume)
+			{
+				SystemLogger.Message("%s is not the journal its checkpoint was made from",
+					qPrintable(m_FileName));
+			}
+		}
 
-			if (lineRead > 0)
+		if (resume)
+		{
+			m_Checkpoint = m_Resume;
+			m_LinesRead = m_Resume.Line();
+		}
+		else
+		{
+			m_Checkpoint.Clear();
+		}
+
+		m_Checkpoint.ReadHead(&file);
+		unsigned int startLine = m_Checkpoint.Line();
+
+		if (binary)
+		{
+			err = ProcessBinary(file, resume);
+		}
+		else
+		{
+			if (resume)
 			{
-				QString line(lineBuffer);
-				line = line.trimmed();
+				err = ResumeLines(file);
+			}
 
-				if (!line.isEmpty())
-				{
-					err = ParseLine(line);
+			LineReader lines(&file, m_ChunkSize, m_MaxLineLength);
 
-					if (err != ERROR_OK)
-					{
-						// Log non-fatal error.
-					}
-				}
+			if (err == ERROR_OK && m_Threads > 1)
+			{
+				err = ProcessPipelined(lines);
 			}
+			else if (err == ERROR_OK)
+			{
+				err = ProcessLines(lines);
+			}
+
+			readErr = lines.LastError();
 		}
-		
+
+		// Lines still waiting to be compacted came before any bad one, so
+		// they're applied whatever happened after them. If one of them
+		// fails, it's the first bad line.
+		Error flushed = FlushWindow();
+
+		if (flushed != ERROR_OK)
+		{
+			err = flushed;
+		}
+		else if (err == ERROR_OK && readErr == LineReader::ERROR_LINE_TOO_LONG)
+		{
+			err = ERROR_LINE_TOO_LONG;
+		}
+		else if (err == ERROR_OK && readErr != LineReader::ERROR_OK)
+		{
+			err = ERROR_READ_FAILED;
+		}
+
+		m_LinesApplied = m_Checkpoint.Line() - startLine;
+
+		// Processing stops at the first bad line, which is the last read. A
+		// binary journal counts its records instead.
+		if (err != ERROR_OK)
+		{
+			SystemLogger.NonFatal("%s %s %u: journal error %d",
+				qPrintable(m_FileName), binary ? "record" : "line", m_LinesRead, err);
+		}
+
 		file.close();
 		
 		if (err == ERROR_OK)
@@ -77,43 +330,472 @@ bool JournalParser::Process()
 	return retval;
 }
 
-JournalParser::Error JournalParser::ParseLine(const QString& fileLine)
+JournalParser::Error JournalParser::ResumeLines(QFile& file)
+{
+	Error retval = ERROR_BAD_CHECKPOINT;
+	qint64 length = m_Resume.Offset() - m_Resume.LineStart();
+
+	// The last line applied must still be there, and still check out,
+	// before anything after it can follow on from it.
+	if (length > 0 && length <= m_MaxLineLength + 1 && file.seek(m_Resume.LineStart()))
+	{
+		QByteArray text = file.read(length);
+		const char* line = text.constData();
+		int lineLength = text.size();
+		quint16 checksum = 0;
+
+		if (lineLength == length)
+		{
+			if (lineLength > 0 && line[lineLength - 1] == '\n')
+			{
+				lineLength--;
+			}
+
+			StringUtils::TrimUtf8(line, lineLength);
+
+			if ((lineLength == 0 || ChecksumLine(line, lineLength, checksum) == ERROR_OK) &&
+				checksum == m_Resume.LineChecksum() && file.seek(m_Resume.Offset()))
+			{
+				retval = ERROR_OK;
+			}
+		}
+	}
+
+	return retval;
+}
+
+JournalParser::Error JournalParser::ProcessLines(LineReader& lines)
+{
+	Error retval = ERROR_OK;
+	const char* lineData = 0;
+	int lineLength = 0;
+
+	// Process the file line by line.
+	while (retval == ERROR_OK && lines.NextLine(lineData, lineLength) &&
+		(lines.Terminated() || !m_CompleteLinesOnly))
+	{
+		m_LinesRead++;
+
+		retval = ParseLine(lineData, lineLength, lines.Position());
+	}
+
+	return retval;
+}
+
+JournalParser::Error JournalParser::ProcessPipelined(LineReader& lines)
+{
+	Error retval = ERROR_OK;
+	QThreadPool pool;
+	JournalFeeder feeder(this, &lines, &pool, m_Threads * BATCHES_PER_THREAD);
+
+	// The feeder has a thread to itself, besides the workers.
+	pool.setMaxThreadCount(m_Threads + 1);
+	pool.start(&feeder);
+
+	// Apply each batch's lines in journal order as its worker finishes.
+	// After a bad line the rest are still waited for, so they can be
+	// freed, but not applied.
+	JournalBatch* batch = feeder.Pop();
+
+	while (batch)
+	{
+		batch->m_Done.acquire();
+
+		for (int count = 0; retval == ERROR_OK && count < batch->m_Lines.size();
+			count++)
+		{
+			m_LinesRead++;
+			retval = batch->m_Lines[count].error;
+
+			if (retval == ERROR_OK)
+			{
+				retval = CommitLine(batch->m_Lines[count], batch->m_Offsets[count]);
+			}
+
+			if (retval != ERROR_OK)
+			{
+				feeder.Abort();
+			}
+		}
+
+		delete batch;
+		feeder.Release();
+		batch = feeder.Pop();
+	}
+
+	pool.waitForDone();
+
+	return retval;
+}
+
+JournalParser::Error JournalParser::ProcessBinary(QFile& file, bool resume)
+{
+	qint64 fileSize = file.size();
+	uchar* mapped = 0;
+
+	// Even the header may not all be there yet.
+	Error retval = m_CompleteLinesOnly ? ERROR_OK : ERROR_MALFORMED_RECORD;
+
+	if (fileSize >= BinaryJournal::HEADER_SIZE)
+	{
+		mapped = file.map(0, fileSize);
+	}
+
+	if (mapped)
+	{
+		retval = ParseRecords(reinterpret_cast<const char*>(mapped), fileSize, resume);
+		file.unmap(mapped);
+	}
+	else if (fileSize >= BinaryJournal::HEADER_SIZE)
+	{
+		QByteArray contents = file.readAll();
+		retval = ParseRecords(contents.constData(), contents.size(), resume);
+	}
+
+	return retval;
+}
+
+JournalParser::Error JournalParser::ParseRecords(const char* data, qint64 size,
+	bool resume)
+{
+	Error retval = ERROR_OK;
+	const char* pos = data + sizeof(BinaryJournal::MAGIC);
+	const char* end = data + size;
+	quint32 version = 0;
+
+	// The file's strings, by their number in it, as interned here. There is
+	// no string 0.
+	QVector<uint> stringIds;
+	stringIds.push_back(0);
+
+	if (!ReadU32(pos, end, version) || version != BinaryJournal::VERSION)
+	{
+		retval = ERROR_UNKNOWN_VERSION;
+	}
+
+	// Lines before the checkpoint have been applied already, but the
+	// strings among them are still needed.
+	if (retval == ERROR_OK && resume)
+	{
+		retval = SkipRecords(pos, end, stringIds);
+	}
+	else if (retval == ERROR_OK)
+	{
+		m_Checkpoint.Start(pos - data);
+	}
+
+	// Records hold whole lines, already tokenized, so there is nothing left
+	// to spread over workers; they are applied as they are read.
+	ParsedLine parsed;
+
+	while (retval == ERROR_OK && pos < end &&
+		(!m_CompleteLinesOnly || WholeRecord(pos, end)))
+	{
+		const char* payload = 0;
+		quint32 length = 0;
+		quint32 checksum = 0;
+
+		m_LinesRead++;
+		retval = NextRecord(pos, end, payload, length, checksum);
+
+		if (retval == ERROR_OK && Checksum::Crc32c(payload, length) != checksum)
+		{
+			retval = ERROR_BAD_CHECKSUM;
+		}
+
+		if (retval == ERROR_OK)
+		{
+			// A string record goes through as a blank line, so the
+			// checkpoint never gets ahead of lines still to be applied.
+			switch (static_cast<uchar>(*payload))
+			{
+			case BinaryJournal::RECORD_STRING:
+				stringIds.push_back(StringDeduplicator::StoreNoCase(payload + 1,
+					length - 1));
+				parsed.updates.clear();
+				break;
+
+			case BinaryJournal::RECORD_LINE:
+				retval = DecodeLine(payload + 1, pos, stringIds, parsed);
+				break;
+
+			default:
+				retval = ERROR_MALFORMED_RECORD;
+				break;
+			}
+		}
+
+		if (retval == ERROR_OK)
+		{
+			parsed.checksum = checksum;
+			retval = CommitLine(parsed, pos - data);
+		}
+	}
+
+	return retval;
+}
+
+JournalParser::Error JournalParser::SkipRecords(const char*& pos, const char* end,
+	QVector<uint>& stringIds) const
+{
+	Error retval = ERROR_OK;
+	const char* data = pos - BinaryJournal::HEADER_SIZE;
+	const char* stop = data + m_Resume.Offset();
+	const char* lastStart = pos;
+	quint32 lastChecksum = 0;
+
+	// Only the string records are read; the lines are stepped over.
+	while (retval == ERROR_OK && pos < stop)
+	{
+		const char* payload = 0;
+		quint32 length = 0;
+
+		lastStart = pos;
+		retval = NextRecord(pos, end, payload, length, lastChecksum);
+
+		if (retval == ERROR_OK &&
+			static_cast<uchar>(*payload) == BinaryJournal::RECORD_STRING)
+		{
+			if (Checksum::Crc32c(payload, length) == lastChecksum)
+			{
+				stringIds.push_back(StringDeduplicator::StoreNoCase(payload + 1,
+					length - 1));
+			}
+			else
+			{
+				retval = ERROR_BAD_CHECKSUM;
+			}
+		}
+	}
+
+	// The records must end exactly at the checkpoint, with the one it
+	// says was applied last.
+	if (retval != ERROR_OK || pos != stop || lastStart - data != m_Resume.LineStart() ||
+		lastChecksum != m_Resume.LineChecksum())
+	{
+		retval = ERROR_BAD_CHECKPOINT;
+	}
+
+	return retval;
+}
+
+JournalParser::Error JournalParser::NextRecord(const char*& pos, const char* end,
+	const char*& payload, quint32& length, quint32& checksum)
+{
+	Error retval = ERROR_MALFORMED_RECORD;
+
+	if (ReadU32(pos, end, length) && ReadU32(pos, end, checksum) &&
+		length > 0 && length <= 0x7fffffffu &&
+		length <= static_cast<quint64>(end - pos))
+	{
+		payload = pos;
+		pos += length;
+		retval = ERROR_OK;
+	}
+
+	return retval;
+}
+
+JournalParser::Error JournalParser::DecodeLine(const char* pos, const char* end,
+	const QVector<uint>& stringIds, ParsedLine& lineDest)
+{
+	Error retval = ERROR_OK;
+	quint32 updates = 0;
+
+	lineDest.updates.clear();
+
+	if (!ReadU32(pos, end, updates))
+	{
+		retval = ERROR_MALFORMED_RECORD;
+	}
+
+	for (quint32 count = 0; retval == ERROR_OK && count < updates; count++)
+	{
+		quint32 parts = 0;
+
+		// A file ID and at least one attribute, each a string number.
+		if (!ReadU32(pos, end, parts) || parts < 2 ||
+			parts > static_cast<quint64>(end - pos) / sizeof(quint32))
+		{
+			retval = ERROR_MALFORMED_RECORD;
+		}
+		else
+		{
+			lineDest.updates.resize(lineDest.updates.size() + 1);
+			ParsedUpdate& update = lineDest.updates.last();
+
+			for (quint32 part = 0; retval == ERROR_OK && part < parts; part++)
+			{
+				quint32 number = 0;
+				ReadU32(pos, end, number);
+
+				if (number == 0 || number >= static_cast<quint32>(stringIds.size()))
+				{
+					retval = ERROR_MALFORMED_RECORD;
+				}
+				else if (part == 0)
+				{
+					update.fileId = stringIds[number];
+				}
+				else
+				{
+					update.attribs.append(stringIds[number]);
+				}
+			}
+
+			if (retval == ERROR_OK)
+			{
+				retval = DecodeValue(pos, end, update.value);
+			}
+		}
+	}
+
+	// Anything left over means the record isn't what it claims to be.
+	if (retval == ERROR_OK && pos != end)
+	{
+		retval = ERROR_MALFORMED_RECORD;
+	}
+
+	return retval;
+}
+
+JournalParser::Error JournalParser::DecodeValue(const char*& pos, const char* end,
+	DataValue& valueDest)
+{
+	Error retval = ERROR_MALFORMED_RECORD;
+
+	if (pos < end)
+	{
+		uchar type = static_cast<uchar>(*pos++);
+		quint32 length = 0;
+
+		if (type == BinaryJournal::VALUE_INTEGER &&
+			end - pos >= static_cast<qint64>(sizeof(qint64)))
+		{
+			valueDest = DataValue::Integer(
+				qFromLittleEndian<qint64>(reinterpret_cast<const uchar*>(pos)));
+			pos += sizeof(qint64);
+			retval = ERROR_OK;
+		}
+		else if (type == BinaryJournal::VALUE_STRING && ReadU32(pos, end, length) &&
+			length <= static_cast<quint64>(end - pos))
+		{
+			valueDest = DataValue(StringDeduplicator::Store(pos, length));
+			pos += length;
+			retval = ERROR_OK;
+		}
+	}
+
+	return retval;
+}
+
+bool JournalParser::WholeRecord(const char* pos, const char* end)
+{
+	quint32 length = 0;
+
+	return (ReadU32(pos, end, length) && end - pos >= static_cast<qint64>(sizeof(quint32)) &&
+		length <= static_cast<quint64>(end - pos) - sizeof(quint32));
+}
+
+bool JournalParser::ReadU32(const char*& pos, const char* end, quint32& value)
+{
+	bool retval = false;
+
+	if (end - pos >= static_cast<qint64>(sizeof(quint32)))
+	{
+		value = qFromLittleEndian<quint32>(reinterpret_cast<const uchar*>(pos));
+		pos += sizeof(quint32);
+		retval = true;
+	}
+
+	return retval;
+}
+
+JournalParser::Error JournalParser::ParseLine(const char* line, int length,
+	qint64 end)
+{
+	ParsedLine parsed;
+	Error retval = TokenizeLine(line, length, parsed);
+
+	if (retval == ERROR_OK)
+	{
+		retval = CommitLine(parsed, end);
+	}
+
+	return retval;
+}
+
+JournalParser::Error JournalParser::TokenizeLine(const char* line, int length,
+	ParsedLine& lineDest) const
 {
 	Error retval = ERROR_OK;
-	QString line = fileLine.trimmed();
 	quint16 checksum = 0;
 
-	ClearUpdates();
-	retval = ChecksumLine(line, checksum);
+	lineDest.updates.clear();
+	lineDest.checksum = 0;
+	StringUtils::TrimUtf8(line, length);
+
+	// Blank lines have no checksum, and nothing to apply.
+	if (length > 0)
+	{
+		retval = ChecksumLine(line, length, checksum);
+	}
 
-	if (retval == ERROR_OK)
+	if (retval == ERROR_OK && length > 0)
 	{
+		lineDest.checksum = checksum;
+
 		StringUtils::Term currTerm;
-		QString termStr("");
-		QString attribPath("");
+		int linePos = 0;
+		const char* termStart = 0;
+		int termLength = 0;
+		const char* attribStart = 0;
+		int attribLength = 0;
 		bool done = false;
-		QString attribName("");
-		bool duplicates = false;
 
 		while (!done)
 		{
-			currTerm = StringUtils::NextTerm(line, termStr);
+			currTerm = StringUtils::NextTerm(line, length, linePos, termStart, termLength);
 
 			if (currTerm == StringUtils::ATTRIB_OR_VALUE)
 			{
-				attribPath = termStr;
-				currTerm = StringUtils::NextTerm(line, termStr);
+				attribStart = termStart;
+				attribLength = termLength;
+				currTerm = StringUtils::NextTerm(line, length, linePos, termStart,
+					termLength);
 
 				if (currTerm == StringUtils::EQUALS)
 				{
-					currTerm = StringUtils::NextTerm(line, termStr);
+					currTerm = StringUtils::NextTerm(line, length, linePos, termStart,
+						termLength);
 
 					if (currTerm == StringUtils::ATTRIB_OR_VALUE ||
 						currTerm == StringUtils::VALUE_ONLY)
 					{
-						if (!CacheUpdate(attribPath, termStr))
+						lineDest.updates.resize(lineDest.updates.size() + 1);
+						ParsedUpdate& update = lineDest.updates.last();
+						QString value;
+						qint64 integerValue = 0;
+
+						if (StringUtils::UnquoteTerm(termStart, termLength, value) !=
+							StringUtils::VALUE_OK)
+						{
+							retval = ERROR_UNFINISHED_VALUE;
+						}
+						else
 						{
-							duplicates = true;
+							// Typed here, where it's spread over the workers,
+							// so applying the line only has to store it.
+							if (StringUtils::ParseInteger(value, integerValue))
+							{
+								update.value = DataValue::Integer(integerValue);
+							}
+							else
+							{
+								update.value = DataValue(StringDeduplicator::Store(value));
+							}
+
+							retval = TokenizePath(attribStart, attribLength, update);
 						}
 					}
 					else
@@ -134,59 +816,197 @@ JournalParser::Error JournalParser::ParseLine(const QString& fileLine)
 			{
 				retval = ERROR_MISSING_ATTRIBUTE;
 			}
+
+			if (retval != ERROR_OK)
+			{
+				done = true;
+			}
 		}
+	}
+
+	return retval;
+}
+
+JournalParser::Error JournalParser::CommitLine(const ParsedLine& line, qint64 end)
+{
+	Error retval = ERROR_OK;
+
+	if (m_CompactWindow <= 1)
+	{
+		retval = CommitNow(line, end);
+	}
+	else if (!m_Compactor->Add(line, end))
+	{
+		// The line can't follow the ones before it, so it goes on its own
+		// once they're done.
+		retval = FlushWindow();
 
-		if (duplicates)
+		if (retval == ERROR_OK)
 		{
-			// Log a warning about the line containing duplicate attribs.
+			retval = CommitNow(line, end);
 		}
+	}
+	else if (m_Compactor->Lines() >= m_CompactWindow)
+	{
+		retval = FlushWindow();
+	}
 
-		if (retval == ERROR_OK)
+	return retval;
+}
+
+JournalParser::Error JournalParser::CommitNow(const ParsedLine& line, qint64 end)
+{
+	Error retval = ERROR_OK;
+
+	if (!m_Output)
+	{
+		retval = ApplyLine(line);
+	}
+	else if (!m_Output->WriteLine(line))
+	{
+		retval = ERROR_WRITE_FAILED;
+	}
+
+	if (retval == ERROR_OK)
+	{
+		m_Checkpoint.Advance(end, line.checksum);
+	}
+
+	return retval;
+}
+
+JournalParser::Error JournalParser::FlushWindow()
+{
+	Error retval = ERROR_OK;
+	const JournalCompactor& window = *m_Compactor;
+	ParsedLine compacted;
+
+	if (!window.IsEmpty() && m_Output)
+	{
+		// Lines keep their own checksums, and go without anything a later
+		// line overwrites. Any left with nothing aren't written at all.
+		for (int count = 0; retval == ERROR_OK && count < window.Lines(); count++)
 		{
-			if (CheckUpdates() == ERROR_OK)
+			window.Compacted(count, compacted);
+			retval = CommitNow(compacted, window.LineEnd(count));
+		}
+	}
+	else if (!window.IsEmpty())
+	{
+		window.Merged(compacted);
+
+		if (ApplyLine(compacted) == ERROR_OK)
+		{
+			for (int count = 0; count < window.Lines(); count++)
 			{
-				ApplyUpdates();
+				m_Checkpoint.Advance(window.LineEnd(count), window.Line(count).checksum);
 			}
-			else
+		}
+		else
+		{
+			// Something in the window doesn't fit the data files, and
+			// nothing of it has been applied. Going a line at a time finds
+			// which, and applies the lines before it, as if there had been
+			// no window.
+			for (int count = 0; retval == ERROR_OK && count < window.Lines(); count++)
 			{
-				// Log a warning about invalid attribs/values.
+				retval = CommitNow(window.Line(count), window.LineEnd(count));
 			}
 		}
 	}
 
+	// The bad line is the one after the last applied.
+	if (retval != ERROR_OK)
+	{
+		m_LinesRead = m_Checkpoint.Line() + 1;
+	}
+
+	m_Compactor->Flush();
+
+	return retval;
+}
+
+qint64 JournalParser::UpdatesDropped() const
+{
+	return m_Compactor->Dropped();
+}
+
+JournalParser::Error JournalParser::ApplyLine(const ParsedLine& line)
+{
+	Error retval = ERROR_OK;
+	bool duplicates = false;
+
+	ClearUpdates();
+
+	for (int count = 0; retval == ERROR_OK && count < line.updates.size(); count++)
+	{
+		retval = CacheUpdate(line.updates[count]);
+	}
+
+	// Nothing on the line is applied unless all of it can be.
+	if (retval == ERROR_OK)
+	{
+		duplicates = !SortUpdates();
+		retval = CheckUpdates();
+	}
+
+	if (duplicates)
+	{
+		// Log a warning about the line containing duplicate attribs.
+	}
+
+	if (retval == ERROR_OK)
+	{
+		ApplyUpdates();
+	}
+
 	return retval;
 }
 
-JournalParser::Error JournalParser::ChecksumLine(QString& line, quint16 &value) const
+JournalParser::Error JournalParser::ChecksumLine(const char* line, int& length,
+	quint16& value) const
 {
 	Error retval = ERROR_OK;
 	value = 0;
 
-	// There must be something to checksum. Empty lines should not have had
-	// a checksum written for them.
-	if (!line.isEmpty() && line.length() > 5)
+	// There must be something to checksum, a space, and four hex digits.
+	// Empty lines should not have had a checksum written for them.
+	if (length > 5)
 	{
-		// A space is required between the line itself and its checksum.
-		if (line.at(line.length() - 5).isSpace())
+		const char* checksumStr = line + length - 4;
+		const char* space = checksumStr - 1;
+
+		// A space is required between the line itself and its checksum. It
+		// may not be ASCII, so back up to the start of its character.
+		while (space > line && checksumStr - space < 4 &&
+			(static_cast<uchar>(*space) & 0xc0) == 0x80)
+		{
+			space--;
+		}
+
+		if (space == line)
+		{
+			retval = ERROR_MISSING_CHECKSUM;
+		}
+		else if (StringUtils::Utf8SpaceLength(space, checksumStr) == checksumStr - space)
 		{
-			QString checksumStr = line.right(4);
-			line = line.left(line.length() - 5);
+			length = space - line;
 
-			QByteArray utf8 = line.toUtf8();
-			quint16 calcChecksum = qChecksum(utf8.data(), utf8.length());
+			// Checked straight from the line's bytes, which are what the
+			// checksum was made from.
+			quint16 calcChecksum = Checksum::Crc16(line, length);
 
 			// Special case for testing.
-			if (m_FixChecksums && checksumStr.compare("****") == 0)
+			if (m_FixChecksums && memcmp(checksumStr, "****", 4) == 0)
 			{
 				// Log a message with the correct checksum.
 			}
 			else
 			{
-				bool isNum = false;
 				quint16 storedChecksum = 0;
-				storedChecksum = checksumStr.toShort(&isNum, 16);
 
-				if (!isNum || storedChecksum != calcChecksum)
+				if (!ParseChecksum(checksumStr, storedChecksum) ||
+					storedChecksum != calcChecksum)
 				{
 					retval = ERROR_BAD_CHECKSUM;
 				}
@@ -210,65 +1030,197 @@ JournalParser::Error JournalParser::ChecksumLine(QString& line, quint16 &value)
 	return retval;
 }
 
-void JournalParser::ClearUpdates()
-{
-	m_PendingUpdates.clear();
-}
-
-bool JournalParser::CacheUpdate(const QString& attribPath, const QString& value)
+bool JournalParser::ParseChecksum(const char* hex, quint16& valueDest)
 {
 	bool retval = true;
-	QString key = attribPath.toLower().trimmed();
+	quint16 value = 0;
 
-	if (m_PendingUpdates.contains(key))
+	for (int count = 0; retval && count < 4; count++)
 	{
-		// Log a message with the specific duplicate attrib and value.
-		retval = false;
+		char ch = hex[count];
+		value <<= 4;
+
+		if (ch >= '0' && ch <= '9')
+		{
+			value |= ch - '0';
+		}
+		else if (ch >= 'a' && ch <= 'f')
+		{
+			value |= ch - 'a' + 10;
+		}
+		else if (ch >= 'A' && ch <= 'F')
+		{
+			value |= ch - 'A' + 10;
+		}
+		else
+		{
+			retval = false;
+		}
 	}
 
-	m_PendingUpdates.insert(key, value);
+	valueDest = value;
+
 	return retval;
 }
 
-JournalParser::Error JournalParser::CheckUpdates() const
+void JournalParser::ClearUpdates()
+{
+	// The updates are kept, along with their storage, for the next line to
+	// reuse.
+	m_UpdateCount = 0;
+}
+
+JournalParser::Error JournalParser::TokenizePath(const char* attribPath, int length,
+	ParsedUpdate& updateDest)
 {
 	Error retval = ERROR_OK;
-	PendingUpdatesMap::const_iterator iter = m_PendingUpdates.begin();
+	const char* pos = attribPath;
+	const char* end = pos + length;
+	const char* dot = static_cast<const char*>(memchr(pos, '.', end - pos));
 
-	while (retval == ERROR_OK && iter != m_PendingUpdates.end())
+	updateDest.attribs.clear();
+
+	if (dot && dot > pos)
 	{
-		QStringList pathParts = iter.key().split('.');
+		updateDest.fileId = StringDeduplicator::StoreNoCase(pos, dot - pos);
 
-		if (pathParts.count() >= 2)
+		while (retval == ERROR_OK && dot)
 		{
-			DataHierarchy* fileHierarchy = 0;
+			pos = dot + 1;
+			dot = static_cast<const char*>(memchr(pos, '.', end - pos));
 
-			if (m_FileTracker)
-			{
-				fileHierarchy = m_FileTracker->Hierarchy(pathParts[0]);
-			}
+			const char* partEnd = dot ? dot : end;
 
-			if (fileHierarchy)
+			if (partEnd > pos)
 			{
-				if (ExistingStructAttribute(pathParts))
-				{
-					// Log non-fatal error for replacing a struct with a basic value.
-					retval = ERROR_STRUCT_REDEFINITION;
-				}
+				updateDest.attribs.append(
+					StringDeduplicator::StoreNoCase(pos, partEnd - pos));
 			}
 			else
 			{
-				// Log non-fatal error for unidentified file.
-				retval = ERROR_FILE_ID_NOT_FOUND;
+				// Log non-fatal error for incomplete attribute path.
+				retval = ERROR_MALFORMED_ATTRIBUTE;
 			}
 		}
+	}
+	else
+	{
+		// Log non-fatal error for incomplete attribute path.
+		retval = ERROR_MALFORMED_ATTRIBUTE;
+	}
+
+	return retval;
+}
+
+JournalParser::Error JournalParser::CacheUpdate(const ParsedUpdate& parsed)
+{
+	Error retval = ERROR_OK;
+
+	if (m_UpdateCount == m_PendingUpdates.size())
+	{
+		m_PendingUpdates.resize(m_UpdateCount + 1);
+	}
+
+	PendingUpdate& update = m_PendingUpdates[m_UpdateCount];
+	update.file = FileRoot(parsed.fileId);
+	update.attribs = parsed.attribs;
+	update.value = parsed.value;
+	update.order = m_UpdateCount;
+
+	if (update.file)
+	{
+		m_UpdateCount++;
+	}
+	else
+	{
+		// Log non-fatal error for unidentified file.
+		retval = ERROR_FILE_ID_NOT_FOUND;
+	}
+
+	return retval;
+}
+
+bool JournalParser::SortUpdates()
+{
+	bool retval = true;
+	PendingUpdates::iterator begin = m_PendingUpdates.begin();
+	PendingUpdates::iterator end = begin + m_UpdateCount;
+
+	std::sort(begin, end, PathLess);
+
+	// Where a line sets the same attribute twice, the last one wins.
+	int kept = 0;
+
+	for (int count = 0; count < m_UpdateCount; count++)
+	{
+		if (count + 1 < m_UpdateCount &&
+			SamePath(m_PendingUpdates[count], m_PendingUpdates[count + 1]))
+		{
+			// Log a message with the specific duplicate attrib and value.
+			retval = false;
+		}
 		else
 		{
-			// Log non-fatal error for incomplete attribute path.
-			retval = ERROR_MALFORMED_ATTRIBUTE;
+			if (kept != count)
+			{
+				std::swap(m_PendingUpdates[kept], m_PendingUpdates[count]);
+			}
+
+			kept++;
+		}
+	}
+
+	m_UpdateCount = kept;
+
+	return retval;
+}
+
+JournalParser::Error JournalParser::CheckUpdates() const
+{
+	Error retval = ERROR_OK;
+	PathWalk walk;
+	walk.file = 0;
+	walk.attribs = 0;
+
+	for (int count = 0; retval == ERROR_OK && count < m_UpdateCount; count++)
+	{
+		const PendingUpdate& update = m_PendingUpdates[count];
+		int last = update.attribs.size() - 1;
+
+		WalkPath(update, false, walk);
+
+		// A walk that stops short has come to a missing struct, which will
+		// be made, or to a basic value, which can't hold one.
+		int depth = walk.nodes.size();
+		DataValue dval = walk.nodes.last()->Value(update.attribs[depth - 1]);
+
+		if (depth <= last)
+		{
+			if (dval.IsBasic())
+			{
+				retval = ERROR_NOT_A_STRUCT;
+			}
+		}
+		else if (dval.IsStruct())
+		{
+			// Log non-fatal error for replacing a struct with a basic value.
+			retval = ERROR_STRUCT_REDEFINITION;
 		}
 
-		iter++;
+		// Nor can the line give a basic value to a struct on the path. Any
+		// path inside another sorts straight after it.
+		if (retval == ERROR_OK && count > 0)
+		{
+			const PendingUpdate& previous = m_PendingUpdates[count - 1];
+
+			if (previous.file == update.file &&
+				previous.attribs.size() < update.attribs.size() &&
+				memcmp(previous.attribs.constData(), update.attribs.constData(),
+					previous.attribs.size() * sizeof(uint)) == 0)
+			{
+				retval = ERROR_NOT_A_STRUCT;
+			}
+		}
 	}
 
 	return retval;
@@ -277,20 +1229,176 @@ JournalParser::Error JournalParser::CheckUpdates() const
 bool JournalParser::ApplyUpdates()
 {
 	bool retval = true;
+	PathWalk walk;
+	walk.file = 0;
+	walk.attribs = 0;
+
+	for (int count = 0; count < m_UpdateCount; count++)
+	{
+		const PendingUpdate& update = m_PendingUpdates[count];
+
+		// CheckUpdates has made sure every walk gets to the last struct.
+		WalkPath(update, true, walk);
+
+		if (walk.nodes.size() == update.attribs.size())
+		{
+			int last = update.attribs.size() - 1;
+			retval = walk.nodes.last()->Set(update.attribs[last], update.value) && retval;
+		}
+		else
+		{
+			retval = false;
+		}
+	}
+
+	return retval;
+}
+
+DataHierarchy* JournalParser::FileRoot(uint fileId)
+{
+	FileRootsHash::const_iterator iter = m_FileRoots.find(fileId);
+	DataHierarchy* retval = 0;
+
+	if (iter != m_FileRoots.end())
+	{
+		retval = iter.value();
+	}
+	else
+	{
+		if (m_FileTracker)
+		{
+			QString id = StringDeduplicator::Retrieve(fileId).ToString().toLower();
+			retval = m_FileTracker->Hierarchy(id);
+		}
+
+		m_FileRoots.insert(fileId, retval);
+	}
 
 	return retval;
 }
 
-bool JournalParser::ExistingStructAttribute(const QStringList& attribPath) const
+void JournalParser::WalkPath(const PendingUpdate& update, bool create,
+	PathWalk& walk) const
+{
+	int parents = update.attribs.size();
+	int shared = 0;
+
+	// Keep as much of the last walk as this path has in common with it.
+	if (walk.file == update.file && !walk.nodes.isEmpty())
+	{
+		shared = 1;
+
+		while (shared < walk.nodes.size() && shared < parents &&
+			(*walk.attribs)[shared - 1] == update.attribs[shared - 1])
+		{
+			shared++;
+		}
+
+		// Carry on from the deepest struct that was actually found.
+		while (!walk.nodes[shared - 1])
+		{
+			shared--;
+		}
+	}
+
+	walk.file = update.file;
+	walk.attribs = &update.attribs;
+	walk.nodes.resize(shared);
+
+	if (walk.nodes.isEmpty())
+	{
+		walk.nodes.push_back(update.file);
+	}
+
+	// The last struct may be cached, which saves walking to it at all.
+	if (walk.nodes.size() < parents)
+	{
+		DataHierarchy* cached = m_PathCache.Find(update.file,
+			update.attribs.constData(), parents - 1);
+
+		if (cached)
+		{
+			walk.nodes.resize(parents);
+			walk.nodes[parents - 1] = cached;
+		}
+	}
+
+	bool walked = false;
+	bool blocked = false;
+
+	while (!blocked && walk.nodes.size() < parents)
+	{
+		DataHierarchy* node = walk.nodes.last();
+		uint attribId = update.attribs[walk.nodes.size() - 1];
+		DataValue dval = node->Value(attribId);
+
+		if (dval.IsStruct())
+		{
+			walk.nodes.push_back(dval.StructValue());
+		}
+		else if (!dval.IsValid() && create)
+		{
+			DataHierarchy* child = DataHierarchy::Create(node->Arena());
+			node->Set(attribId, child);
+			walk.nodes.push_back(child);
+		}
+		else
+		{
+			blocked = true;
+		}
+
+		walked = true;
+	}
+
+	// Nothing is cached for a path that stopped short, so making the
+	// missing structs later can't leave the cache out of date.
+	if (walked && !blocked && parents > 1)
+	{
+		m_PathCache.Insert(update.file, update.attribs.constData(), parents - 1,
+			walk.nodes.last());
+	}
+}
+
+bool JournalParser::PathLess(const PendingUpdate& first, const PendingUpdate& second)
 {
 	bool retval = false;
 
-	if (attribPath.count() > 1)
+	if (first.file != second.file)
+	{
+		retval = (first.file < second.file);
+	}
+	else
 	{
-		// Work down the tree until we find the final attrib, or a
-		// missing attrib - which is fine, we'll create the structs
-		// as we go.
+		int common = qMin(first.attribs.size(), second.attribs.size());
+		int count = 0;
+
+		while (count < common && first.attribs[count] == second.attribs[count])
+		{
+			count++;
+		}
+
+		if (count < common)
+		{
+			retval = (first.attribs[count] < second.attribs[count]);
+		}
+		else if (first.attribs.size() != second.attribs.size())
+		{
+			retval = (first.attribs.size() < second.attribs.size());
+		}
+		else
+		{
+			// The same path; keep them in line order.
+			retval = (first.order < second.order);
+		}
 	}
 
 	return retval;
 }
+
+bool JournalParser::SamePath(const PendingUpdate& first, const PendingUpdate& second)
+{
+	return (first.file == second.file &&
+		first.attribs.size() == second.attribs.size() &&
+		memcmp(first.attribs.constData(), second.attribs.constData(),
+			first.attribs.size() * sizeof(uint)) == 0);
+}
@@ -2,7 +2,8 @@
 // JournalParser.h
 //
 // Read a journal file and apply updates to the data files, checking each
-// transaction's integrity.
+// transaction's integrity. Journals are either text or the binary format
+// described in BinaryJournal.h, which is told apart by its magic.
 //
 // (c) 2014 Graham West
 
@@ -10,12 +11,21 @@
 #define JOURNALPARSER_H
 
 // Library headers.
-#include <QMap>
-#include <QPair>
+#include <QHash>
 #include <QString>
+#include <QVarLengthArray>
+#include <QVector>
 
 // Application headers.
 #include "DataFileTracker.h"
+#include "DataHierarchy.h"
+#include "JournalCheckpoint.h"
+#include "PathCache.h"
+
+class JournalCompactor;
+class JournalWriter;
+class LineReader;
+class QFile;
 
 class JournalParser
 {
@@ -31,36 +41,189 @@ public:
 		ERROR_NO_EQUALS,
 		ERROR_FILE_ID_NOT_FOUND,
 		ERROR_STRUCT_REDEFINITION,
-		ERROR_UNKNOWN_TERM
+		ERROR_UNKNOWN_TERM,
+		ERROR_NOT_A_STRUCT,
+		ERROR_LINE_TOO_LONG,
+		ERROR_UNKNOWN_VERSION,
+		ERROR_MALFORMED_RECORD,
+		ERROR_WRITE_FAILED,
+		ERROR_BAD_CHECKPOINT,
+		ERROR_READ_FAILED
 	};
 
+	// Attribute paths are split up once, as they're read, into the file's
+	// root and the interned IDs of the attributes below it. Few paths are
+	// deep enough to need more than the inline space.
+	static const int PATH_CAPACITY = 8;
+	typedef QVarLengthArray<uint, PATH_CAPACITY> PathIds;
+
+	// A line as it is read: checked and tokenized, but with its files not
+	// yet looked up. Values are already typed, as the data files keep them.
+	typedef struct ParsedUpdate {
+		uint fileId;
+		PathIds attribs;
+		DataValue value;
+	} ParsedUpdate;
+
+	// The checksum is the one the line was checked against: the text's
+	// CRC-16, or the record's CRC-32C. Blank lines have none, so 0.
+	typedef struct ParsedLine {
+		QVector<ParsedUpdate> updates;
+		quint32 checksum;
+		Error error;
+	} ParsedLine;
+
 	explicit JournalParser(const QString& fileName, DataFileTracker* tracker,
 		bool fixChecksums = false);
 	~JournalParser();
 
+	// Buffering for reading the journal; see LineReader.
+	inline void ChunkSize(int newSize) { m_ChunkSize = newSize; }
+	inline int ChunkSize() const { return m_ChunkSize; }
+
+	inline void MaxLineLength(int newLength) { m_MaxLineLength = newLength; }
+	inline int MaxLineLength() const { return m_MaxLineLength; }
+
+	// With more than one thread, lines are read on one thread, checksummed
+	// and tokenized on this many workers, and applied in order on the
+	// thread calling Process.
+	inline void Threads(int newThreads) { m_Threads = newThreads; }
+	inline int Threads() const { return m_Threads; }
+
+	// While the journal is still being written, its last line may only be
+	// partly there. With this set, a last line without its newline, or a
+	// last record cut short, is left for the next Process to pick up.
+	inline void CompleteLinesOnly(bool completeOnly) { m_CompleteLinesOnly = completeOnly; }
+	inline bool CompleteLinesOnly() const { return m_CompleteLinesOnly; }
+
+	// Lines are gathered up this many at a time, and only the last update
+	// among them to each attribute is kept; see JournalCompactor. The data
+	// files end up just as if every line had been applied in turn. With 1,
+	// each line is applied as soon as it's read.
+	inline void CompactWindow(int lines) { m_CompactWindow = lines; }
+	inline int CompactWindow() const { return m_CompactWindow; }
+
+	// Updates left out by compacting, during the last Process or Convert.
+	qint64 UpdatesDropped() const;
+
+	// Carry on after the checkpoint's last line, if the checkpoint was made
+	// from this journal, and that line is still there as it was. Otherwise
+	// the journal is replayed from the start.
+	inline void Resume(const JournalCheckpoint& from) { m_Resume = from; }
+
+	// How far Process got: the end of the last line applied.
+	inline const JournalCheckpoint& Checkpoint() const { return m_Checkpoint; }
+	inline unsigned int LinesApplied() const { return m_LinesApplied; }
+
 	bool Process();
 
+	// Read the journal and write each line to output, in whichever format
+	// it was opened with, rather than applying it. Needs no data files.
+	bool Convert(JournalWriter& output);
+
+	static bool IsBinary(const QString& fileName);
+
 private:
 	JournalParser();
 	JournalParser(const JournalParser& src);
 	JournalParser& operator=(const JournalParser& src);
 
-	Error ParseLine(const QString& fileLine);
-	Error ChecksumLine(QString& line, quint16& value) const;
+	friend class JournalBatch;
+	friend class JournalFeeder;
+
+	// Lines go to the workers this many at a time, and each worker can
+	// have this many batches read ahead of the applier.
+	static const int BATCH_LINES = 256;
+	static const int BATCHES_PER_THREAD = 4;
+
+	typedef struct PendingUpdate {
+		DataHierarchy* file;
+		PathIds attribs;
+		DataValue value;
+		int order;
+	} PendingUpdate;
+
+	typedef QVector<PendingUpdate> PendingUpdates;
+
+	// The structs down an attribute path, starting with the file's root.
+	// Pending updates are sorted by path, so neighbours mostly share a
+	// prefix, and each walk carries on from the one before rather than
+	// starting again from the file. A struct found in the path cache skips
+	// the ones above it, which are left as 0.
+	typedef struct PathWalk {
+		DataHierarchy* file;
+		const PathIds* attribs;
+		QVector<DataHierarchy*> nodes;
+	} PathWalk;
+
+	bool Run();
+	Error ProcessLines(LineReader& lines);
+	Error ProcessPipelined(LineReader& lines);
+	Error ResumeLines(QFile& file);
+	Error ProcessBinary(QFile& file, bool resume);
+	Error ParseRecords(const char* data, qint64 size, bool resume);
+	Error SkipRecords(const char*& pos, const char* end, QVector<uint>& stringIds) const;
+	Error ParseLine(const char* line, int length, qint64 end);
+	Error TokenizeLine(const char* line, int length, ParsedLine& lineDest) const;
+	Error CommitLine(const ParsedLine& line, qint64 end);
+	Error CommitNow(const ParsedLine& line, qint64 end);
+	Error FlushWindow();
+	Error ApplyLine(const ParsedLine& line);
+
+	// On success length no longer covers the checksum.
+	Error ChecksumLine(const char* line, int& length, quint16& value) const;
 	void ClearUpdates();
-	bool CacheUpdate(const QString& attribPath, const QString& value);
+	Error CacheUpdate(const ParsedUpdate& parsed);
+	bool SortUpdates();
 	Error CheckUpdates() const;
 	bool ApplyUpdates();
-	bool ExistingStructAttribute(const QStringList& attribPath) const;
+	DataHierarchy* FileRoot(uint fileId);
+	void WalkPath(const PendingUpdate& update, bool create, PathWalk& walk) const;
+
+	static Error TokenizePath(const char* attribPath, int length,
+		ParsedUpdate& updateDest);
+	static bool ParseChecksum(const char* hex, quint16& valueDest);
+	static Error DecodeLine(const char* pos, const char* end,
+		const QVector<uint>& stringIds, ParsedLine& lineDest);
+	static Error DecodeValue(const char*& pos, const char* end, DataValue& valueDest);
+	static Error NextRecord(const char*& pos, const char* end, const char*& payload,
+		quint32& length, quint32& checksum);
+	static bool WholeRecord(const char* pos, const char* end);
+	static bool ReadU32(const char*& pos, const char* end, quint32& value);
+	static bool PathLess(const PendingUpdate& first, const PendingUpdate& second);
+	static bool SamePath(const PendingUpdate& first, const PendingUpdate& second);
 
-	typedef QMap<QString, QString> PendingUpdatesMap;
-	
-	PendingUpdatesMap m_PendingUpdates;
+	typedef QHash<uint, DataHierarchy*> FileRootsHash;
 
 	QString m_FileName;
 	DataFileTracker* m_FileTracker;
 	bool m_FixChecksums;
+	int m_ChunkSize;
+	int m_MaxLineLength;
+	int m_Threads;
+	bool m_CompleteLinesOnly;
+	int m_CompactWindow;
 	unsigned int m_LinesRead;
+	unsigned int m_LinesApplied;
+
+	// Where Convert sends lines; 0 while they're being applied.
+	JournalWriter* m_Output;
+
+	JournalCheckpoint m_Resume;
+	JournalCheckpoint m_Checkpoint;
+
+	// Lines waiting to be compacted, and how every path has been used.
+	JournalCompactor* m_Compactor;
+
+	PendingUpdates m_PendingUpdates;
+	int m_UpdateCount;
+
+	// File roots by the interned ID of the file's ID, so each is only
+	// looked up in the tracker once per Process.
+	FileRootsHash m_FileRoots;
+
+	// Filled in as paths are walked, including by the const CheckUpdates.
+	mutable PathCache m_PathCache;
 };
 
 #endif // JOURNALPARSER_H
\ No newline at end of file
@@ -0,0 +1,164 @@
+//
+// JournalWatcher.h
+//
+// Wait for a journal to be written to, so it can be followed as it grows.
+//
+// (c) 2014 Graham West
+
+// Class header, always comes first.
+#include "JournalWatcher.h"
+
+// System headers.
+#if defined(Q_OS_LINUX)
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+// Library headers.
+#include <QFile>
+#include <QFileInfo>
+#include <QThread>
+
+JournalWatcher::JournalWatcher(const QString& fileName) : m_FileName(fileName),
+	m_Notify(-1), m_Watch(-1), m_Size(-1)
+{
+}
+
+JournalWatcher::~JournalWatcher()
+{
+	Stop();
+}
+
+void JournalWatcher::Start()
+{
+	Stop();
+
+#if defined(Q_OS_LINUX)
+	m_Notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+
+	AddWatch();
+
+	QFileInfo info(m_FileName);
+	m_Size = info.exists() ? info.size() : -1;
+	m_Modified = info.lastModified();
+}
+
+void JournalWatcher::Stop()
+{
+#if defined(Q_OS_LINUX)
+	if (m_Notify >= 0)
+	{
+		close(m_Notify);
+	}
+#endif
+
+	m_Notify = -1;
+	m_Watch = -1;
+}
+
+bool JournalWatcher::Wait(int timeoutMs)
+{
+	bool retval = false;
+	bool watching = (m_Watch >= 0);
+
+	// The journal may not have been there to watch last time. If it is now,
+	// whatever happened to it meanwhile went unseen, so look straight away.
+	AddWatch();
+
+	if (!watching && m_Watch >= 0)
+	{
+		retval = true;
+	}
+	else if (m_Watch >= 0)
+	{
+		retval = WaitForEvents(timeoutMs);
+	}
+	else
+	{
+		retval = WaitByPolling(timeoutMs);
+	}
+
+	return retval;
+}
+
+bool JournalWatcher::WaitForEvents(int timeoutMs)
+{
+	bool retval = false;
+
+#if defined(Q_OS_LINUX)
+	struct pollfd pending;
+	pending.fd = m_Notify;
+	pending.events = POLLIN;
+	pending.revents = 0;
+
+	if (poll(&pending, 1, timeoutMs) > 0)
+	{
+		// Events are only a prompt to look, so all that matters is whether
+		// the journal itself went away, and has to be watched again.
+		char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+		ssize_t length = 0;
+
+		while ((length = read(m_Notify, events, sizeof(events))) > 0)
+		{
+			for (const char* pos = events; pos < events + length;
+				pos += sizeof(struct inotify_event) +
+					reinterpret_cast<const struct inotify_event*>(pos)->len)
+			{
+				const struct inotify_event* event =
+					reinterpret_cast<const struct inotify_event*>(pos);
+
+				if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED))
+				{
+					if (m_Watch >= 0 && !(event->mask & IN_IGNORED))
+					{
+						inotify_rm_watch(m_Notify, m_Watch);
+					}
+
+					m_Watch = -1;
+				}
+			}
+		}
+
+		retval = true;
+	}
+#else
+	Q_UNUSED(timeoutMs);
+#endif
+
+	return retval;
+}
+
+bool JournalWatcher::WaitByPolling(int timeoutMs)
+{
+	bool retval = false;
+
+	// Only one look is taken, so a caller waiting longer can see between
+	// looks whether it has been asked to stop.
+	QThread::msleep(qBound(0, timeoutMs, static_cast<int>(POLL_INTERVAL)));
+
+	QFileInfo info(m_FileName);
+	qint64 size = info.exists() ? info.size() : -1;
+	QDateTime modified = info.lastModified();
+
+	if (size != m_Size || modified != m_Modified)
+	{
+		m_Size = size;
+		m_Modified = modified;
+		retval = true;
+	}
+
+	return retval;
+}
+
+void JournalWatcher::AddWatch()
+{
+#if defined(Q_OS_LINUX)
+	if (m_Notify >= 0 && m_Watch < 0)
+	{
+		m_Watch = inotify_add_watch(m_Notify, QFile::encodeName(m_FileName).constData(),
+			IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+	}
+#endif
+}
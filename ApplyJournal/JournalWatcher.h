@@ -0,0 +1,60 @@
+//
+// JournalWatcher.h
+//
+// Wait for a journal to be written to, so it can be followed as it grows.
+//
+// (c) 2014 Graham West
+
+#if !defined(JOURNALWATCHER_H)
+#define JOURNALWATCHER_H
+
+// Library headers.
+#include <QDateTime>
+#include <QString>
+
+// On Linux the journal is watched with inotify. Elsewhere, or if that can't
+// be set up, its size and modification time are polled instead. Either way
+// Wait may return early with nothing new, so the caller should always look.
+//
+// A journal that is moved or deleted stops being watched, and whatever file
+// next has its name is watched instead once it appears.
+class JournalWatcher
+{
+public:
+	explicit JournalWatcher(const QString& fileName);
+	~JournalWatcher();
+
+	// How often the journal is looked at when it can't be watched.
+	static const int POLL_INTERVAL = 250;
+
+	void Start();
+	void Stop();
+
+	// Returns true as soon as the journal may have changed, or false if it
+	// hasn't by the time Wait returns. A wait on inotify lasts up to
+	// timeoutMs, and is cut short by a signal. Polling looks only once, after
+	// at most POLL_INTERVAL, so the caller can check whether it should stop.
+	bool Wait(int timeoutMs);
+
+private:
+	JournalWatcher();
+	JournalWatcher(const JournalWatcher& src);
+	JournalWatcher& operator=(const JournalWatcher& src);
+
+	bool WaitForEvents(int timeoutMs);
+	bool WaitByPolling(int timeoutMs);
+	void AddWatch();
+
+	QString m_FileName;
+
+	// inotify's descriptor, and the journal's watch on it; -1 if there is
+	// none.
+	int m_Notify;
+	int m_Watch;
+
+	// What polling last saw.
+	qint64 m_Size;
+	QDateTime m_Modified;
+};
+
+#endif // JOURNALWATCHER_H
@@ -0,0 +1,231 @@
+//
+// JournalWriter.h
+//
+// Write journal lines out again, as checksummed text or in the binary
+// format described in BinaryJournal.h.
+//
+// (c) 2014 Graham West
+
+// Class header, always comes first.
+#include "JournalWriter.h"
+
+// Library headers.
+#include <QtEndian>
+
+// Common headers.
+#include "Checksum.h"
+#include "StringDeduplicator.h"
+#include "StringUtils.h"
+
+// Application headers.
+#include "BinaryJournal.h"
+
+JournalWriter::JournalWriter(Format format) : m_Format(format), m_Ok(false),
+	m_StringCount(0)
+{
+}
+
+JournalWriter::~JournalWriter()
+{
+	Close();
+}
+
+bool JournalWriter::Open(const QString& fileName)
+{
+	Close();
+
+	m_Buffer.clear();
+	m_StringNumbers.clear();
+	m_StringCount = 0;
+	m_File.setFileName(fileName);
+	m_Ok = m_File.open(QIODevice::WriteOnly);
+
+	if (m_Ok && m_Format == FORMAT_BINARY)
+	{
+		m_Buffer.append(BinaryJournal::MAGIC, sizeof(BinaryJournal::MAGIC));
+		AppendU32(m_Buffer, BinaryJournal::VERSION);
+	}
+
+	return m_Ok;
+}
+
+bool JournalWriter::WriteLine(const JournalParser::ParsedLine& line)
+{
+	if (m_Ok && !line.updates.isEmpty())
+	{
+		if (m_Format == FORMAT_BINARY)
+		{
+			AppendBinary(line);
+		}
+		else
+		{
+			AppendText(line);
+		}
+
+		if (m_Buffer.size() >= FLUSH_SIZE)
+		{
+			m_Ok = Flush();
+		}
+	}
+
+	return m_Ok;
+}
+
+bool JournalWriter::Close()
+{
+	bool retval = false;
+
+	if (m_File.isOpen())
+	{
+		retval = Flush() && m_Ok;
+		m_File.close();
+	}
+
+	m_Ok = false;
+
+	return retval;
+}
+
+void JournalWriter::AppendText(const JournalParser::ParsedLine& line)
+{
+	static const char HEX_DIGITS[] = "0123456789ABCDEF";
+	int start = m_Buffer.size();
+
+	for (int count = 0; count < line.updates.size(); count++)
+	{
+		const JournalParser::ParsedUpdate& update = line.updates[count];
+		InternedString fileId = StringDeduplicator::Retrieve(update.fileId);
+
+		if (count > 0)
+		{
+			m_Buffer.append(' ');
+		}
+
+		m_Buffer.append(fileId.Data(), fileId.Length());
+
+		for (int attrib = 0; attrib < update.attribs.size(); attrib++)
+		{
+			InternedString name = StringDeduplicator::Retrieve(update.attribs[attrib]);
+			m_Buffer.append('.');
+			m_Buffer.append(name.Data(), name.Length());
+		}
+
+		m_Buffer.append('=');
+
+		if (update.value.IsInteger())
+		{
+			m_Buffer.append(QByteArray::number(update.value.IntegerValue()));
+		}
+		else
+		{
+			m_Buffer.append(StringUtils::QuoteTerm(update.value.BasicString()).toUtf8());
+		}
+	}
+
+	// The checksum covers the line's bytes as they are written.
+	quint16 checksum = Checksum::Crc16(m_Buffer.constData() + start,
+		m_Buffer.size() - start);
+
+	m_Buffer.append(' ');
+
+	for (int shift = 12; shift >= 0; shift -= 4)
+	{
+		m_Buffer.append(HEX_DIGITS[(checksum >> shift) & 0xf]);
+	}
+
+	m_Buffer.append('\n');
+}
+
+void JournalWriter::AppendBinary(const JournalParser::ParsedLine& line)
+{
+	// Every string the line uses goes out ahead of it, the first time.
+	m_Payload.clear();
+	m_Payload.append(static_cast<char>(BinaryJournal::RECORD_LINE));
+	AppendU32(m_Payload, line.updates.size());
+
+	for (int count = 0; count < line.updates.size(); count++)
+	{
+		const JournalParser::ParsedUpdate& update = line.updates[count];
+
+		AppendU32(m_Payload, update.attribs.size() + 1);
+		AppendU32(m_Payload, StringNumber(update.fileId));
+
+		for (int attrib = 0; attrib < update.attribs.size(); attrib++)
+		{
+			AppendU32(m_Payload, StringNumber(update.attribs[attrib]));
+		}
+
+		if (update.value.IsInteger())
+		{
+			m_Payload.append(static_cast<char>(BinaryJournal::VALUE_INTEGER));
+			AppendI64(m_Payload, update.value.IntegerValue());
+		}
+		else
+		{
+			InternedString value = StringDeduplicator::Retrieve(update.value.BasicValue());
+			m_Payload.append(static_cast<char>(BinaryJournal::VALUE_STRING));
+			AppendU32(m_Payload, value.Length());
+			m_Payload.append(value.Data(), value.Length());
+		}
+	}
+
+	AppendRecord(m_Payload);
+}
+
+void JournalWriter::AppendRecord(const QByteArray& payload)
+{
+	AppendU32(m_Buffer, payload.size());
+	AppendU32(m_Buffer, Checksum::Crc32c(payload.constData(), payload.size()));
+	m_Buffer.append(payload);
+}
+
+quint32 JournalWriter::StringNumber(uint id)
+{
+	// String IDs are dense, so a vector indexed by ID will do.
+	if (id >= static_cast<uint>(m_StringNumbers.size()))
+	{
+		int newSize = qMax(static_cast<int>(id), StringDeduplicator::Total()) + 1;
+		m_StringNumbers.reserve(newSize);
+
+		while (m_StringNumbers.size() < newSize)
+		{
+			m_StringNumbers.push_back(0);
+		}
+	}
+
+	if (m_StringNumbers[id] == 0)
+	{
+		InternedString str = StringDeduplicator::Retrieve(id);
+		QByteArray record;
+
+		record.append(static_cast<char>(BinaryJournal::RECORD_STRING));
+		record.append(str.Data(), str.Length());
+		AppendRecord(record);
+
+		m_StringNumbers[id] = ++m_StringCount;
+	}
+
+	return m_StringNumbers[id];
+}
+
+bool JournalWriter::Flush()
+{
+	bool retval = (m_File.write(m_Buffer) == m_Buffer.size());
+	m_Buffer.clear();
+
+	return retval;
+}
+
+void JournalWriter::AppendU32(QByteArray& dest, quint32 value)
+{
+	uchar bytes[sizeof(quint32)];
+	qToLittleEndian(value, bytes);
+	dest.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+}
+
+void JournalWriter::AppendI64(QByteArray& dest, qint64 value)
+{
+	uchar bytes[sizeof(qint64)];
+	qToLittleEndian(value, bytes);
+	dest.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+}
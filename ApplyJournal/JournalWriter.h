@@ -0,0 +1,72 @@
+//
+// JournalWriter.h
+//
+// Write journal lines out again, as checksummed text or in the binary
+// format described in BinaryJournal.h.
+//
+// (c) 2014 Graham West
+
+#if !defined(JOURNALWRITER_H)
+#define JOURNALWRITER_H
+
+// Library headers.
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <QVector>
+
+// Application headers.
+#include "JournalParser.h"
+
+class JournalWriter
+{
+public:
+	// Numbered as the format versions are.
+	enum Format {
+		FORMAT_TEXT = 1,
+		FORMAT_BINARY = 2
+	};
+
+	explicit JournalWriter(Format format);
+	~JournalWriter();
+
+	inline Format OutputFormat() const { return m_Format; }
+
+	bool Open(const QString& fileName);
+
+	// Blank lines have nothing to write, and are dropped.
+	bool WriteLine(const JournalParser::ParsedLine& line);
+
+	// False if anything failed to be written since Open.
+	bool Close();
+
+private:
+	JournalWriter();
+	JournalWriter(const JournalWriter& src);
+	JournalWriter& operator=(const JournalWriter& src);
+
+	// Output is gathered up and written this much at a time.
+	static const int FLUSH_SIZE = 64 * 1024;
+
+	void AppendText(const JournalParser::ParsedLine& line);
+	void AppendBinary(const JournalParser::ParsedLine& line);
+	void AppendRecord(const QByteArray& payload);
+	quint32 StringNumber(uint id);
+	bool Flush();
+
+	static void AppendU32(QByteArray& dest, quint32 value);
+	static void AppendI64(QByteArray& dest, qint64 value);
+
+	Format m_Format;
+	QFile m_File;
+	QByteArray m_Buffer;
+	QByteArray m_Payload;
+	bool m_Ok;
+
+	// The number each interned ID was given in the binary file, or 0 if
+	// it hasn't been written yet.
+	QVector<quint32> m_StringNumbers;
+	quint32 m_StringCount;
+};
+
+#endif // JOURNALWRITER_H
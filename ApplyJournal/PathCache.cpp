@@ -0,0 +1,213 @@
+//
+// PathCache.h
+//
+// Remember which struct an attribute path leads to, for the most recently
+// used paths, so busy paths don't have to be walked a level at a time.
+//
+// (c) 2014 Graham West
+
+// Class header, always comes first.
+#include "PathCache.h"
+
+// System headers.
+#include <string.h>
+
+// Common headers.
+#include "StringDeduplicator.h"
+
+PathCache::PathCache(int capacity) : m_Capacity(qMax(capacity, 1)), m_Used(0),
+	m_Newest(-1), m_Oldest(-1), m_Generation(StringDeduplicator::Generation())
+{
+	int buckets = 1;
+
+	// At least one bucket per entry, and a power of two so the hash can be
+	// masked.
+	while (buckets < m_Capacity)
+	{
+		buckets *= 2;
+	}
+
+	m_Entries.resize(m_Capacity);
+	m_Buckets.fill(-1, buckets);
+}
+
+PathCache::~PathCache()
+{
+}
+
+DataHierarchy* PathCache::Find(const DataHierarchy* file, const uint* attribs,
+	int depth)
+{
+	DataHierarchy* retval = 0;
+
+	CheckGeneration();
+
+	if (depth <= MAX_DEPTH)
+	{
+		int index = Lookup(file, attribs, depth, Hash(file, attribs, depth));
+
+		if (index >= 0)
+		{
+			MakeNewest(index);
+			retval = m_Entries[index].node;
+		}
+	}
+
+	return retval;
+}
+
+void PathCache::Insert(const DataHierarchy* file, const uint* attribs, int depth,
+	DataHierarchy* node)
+{
+	CheckGeneration();
+
+	if (depth <= MAX_DEPTH && node)
+	{
+		uint hash = Hash(file, attribs, depth);
+		int index = Lookup(file, attribs, depth, hash);
+
+		if (index < 0)
+		{
+			if (m_Used < m_Capacity)
+			{
+				index = m_Used++;
+			}
+			else
+			{
+				// Reuse the entry used longest ago, taking it out of its
+				// bucket's chain first.
+				index = m_Oldest;
+				Unlink(index);
+
+				int* link = &m_Buckets[m_Entries[index].hash & (m_Buckets.size() - 1)];
+
+				while (*link != index)
+				{
+					link = &m_Entries[*link].chain;
+				}
+
+				*link = m_Entries[index].chain;
+			}
+
+			Entry& entry = m_Entries[index];
+			int& bucket = m_Buckets[hash & (m_Buckets.size() - 1)];
+
+			entry.file = file;
+			memcpy(entry.attribs, attribs, depth * sizeof(uint));
+			entry.depth = depth;
+			entry.hash = hash;
+			entry.chain = bucket;
+			entry.node = node;
+			bucket = index;
+
+			PushNewest(index);
+		}
+		else
+		{
+			m_Entries[index].node = node;
+			MakeNewest(index);
+		}
+	}
+}
+
+void PathCache::Clear()
+{
+	m_Buckets.fill(-1);
+	m_Used = 0;
+	m_Newest = -1;
+	m_Oldest = -1;
+	m_Generation = StringDeduplicator::Generation();
+}
+
+int PathCache::Lookup(const DataHierarchy* file, const uint* attribs, int depth,
+	uint hash) const
+{
+	int retval = m_Buckets[hash & (m_Buckets.size() - 1)];
+
+	while (retval >= 0)
+	{
+		const Entry& entry = m_Entries[retval];
+
+		if (entry.hash == hash && entry.file == file && entry.depth == depth &&
+			memcmp(entry.attribs, attribs, depth * sizeof(uint)) == 0)
+		{
+			break;
+		}
+
+		retval = entry.chain;
+	}
+
+	return retval;
+}
+
+void PathCache::Unlink(int index)
+{
+	Entry& entry = m_Entries[index];
+
+	if (entry.newer >= 0)
+	{
+		m_Entries[entry.newer].older = entry.older;
+	}
+	else
+	{
+		m_Newest = entry.older;
+	}
+
+	if (entry.older >= 0)
+	{
+		m_Entries[entry.older].newer = entry.newer;
+	}
+	else
+	{
+		m_Oldest = entry.newer;
+	}
+}
+
+void PathCache::MakeNewest(int index)
+{
+	if (index != m_Newest)
+	{
+		Unlink(index);
+		PushNewest(index);
+	}
+}
+
+void PathCache::PushNewest(int index)
+{
+	m_Entries[index].older = m_Newest;
+	m_Entries[index].newer = -1;
+
+	if (m_Newest >= 0)
+	{
+		m_Entries[m_Newest].newer = index;
+	}
+
+	m_Newest = index;
+
+	if (m_Oldest < 0)
+	{
+		m_Oldest = index;
+	}
+}
+
+void PathCache::CheckGeneration()
+{
+	if (m_Generation != StringDeduplicator::Generation())
+	{
+		Clear();
+	}
+}
+
+uint PathCache::Hash(const DataHierarchy* file, const uint* attribs, int depth)
+{
+	quint64 fileBits = reinterpret_cast<quintptr>(file);
+	uint retval = static_cast<uint>(fileBits ^ (fileBits >> 32)) * 0x9E3779B1u;
+
+	for (int count = 0; count < depth; count++)
+	{
+		retval = (retval ^ attribs[count]) * 0x9E3779B1u;
+		retval ^= retval >> 15;
+	}
+
+	return retval;
+}
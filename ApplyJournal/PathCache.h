@@ -0,0 +1,79 @@
+//
+// PathCache.h
+//
+// Remember which struct an attribute path leads to, for the most recently
+// used paths, so busy paths don't have to be walked a level at a time.
+//
+// (c) 2014 Graham West
+
+#if !defined(PATHCACHE_H)
+#define PATHCACHE_H
+
+// Library headers.
+#include <QVector>
+
+class DataHierarchy;
+
+// A path is a file's root and the interned IDs of the attributes below it.
+// Once full, adding a path pushes out the one used longest ago.
+//
+// A journal never removes a struct, and only makes one where there was
+// none, so a cached struct stays valid until the data files themselves
+// change, when the cache must be cleared. Compacting the interned strings
+// renumbers the IDs, which the cache notices and clears itself for.
+class PathCache
+{
+public:
+	static const int DEFAULT_CAPACITY = 4096;
+
+	// Longer paths are never cached.
+	static const int MAX_DEPTH = 8;
+
+	explicit PathCache(int capacity = DEFAULT_CAPACITY);
+	~PathCache();
+
+	inline int Capacity() const { return m_Capacity; }
+	inline int Size() const { return m_Used; }
+
+	// The struct at the end of the path, or 0 if it isn't cached.
+	DataHierarchy* Find(const DataHierarchy* file, const uint* attribs, int depth);
+	void Insert(const DataHierarchy* file, const uint* attribs, int depth,
+		DataHierarchy* node);
+	void Clear();
+
+private:
+	PathCache(const PathCache& src);
+	PathCache& operator=(const PathCache& src);
+
+	// Entries are linked from newest to oldest use, and each hash bucket
+	// chains its entries together. -1 ends both.
+	typedef struct Entry {
+		const DataHierarchy* file;
+		uint attribs[MAX_DEPTH];
+		int depth;
+		uint hash;
+		DataHierarchy* node;
+		int newer;
+		int older;
+		int chain;
+	} Entry;
+
+	int Lookup(const DataHierarchy* file, const uint* attribs, int depth,
+		uint hash) const;
+	void Unlink(int index);
+	void MakeNewest(int index);
+	void PushNewest(int index);
+	void CheckGeneration();
+
+	static uint Hash(const DataHierarchy* file, const uint* attribs, int depth);
+
+	QVector<Entry> m_Entries;
+	QVector<int> m_Buckets;
+	int m_Capacity;
+	int m_Used;
+	int m_Newest;
+	int m_Oldest;
+	int m_Generation;
+};
+
+#endif // PATHCACHE_H
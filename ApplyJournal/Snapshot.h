@@ -0,0 +1,46 @@
+//
+// Snapshot.h
+//
+// Layout of the binary snapshot of a data hierarchy, shared by
+// SnapshotReader and SnapshotWriter.
+//
+// (c) 2014 Graham West
+
+#if !defined(SNAPSHOT_H)
+#define SNAPSHOT_H
+
+// Library headers.
+#include <QtGlobal>
+
+// All values are little-endian quint32s, in this order:
+//
+//   header      magic, version, attribute count, value count, integer
+//               count, node count, child count
+//   attributes  per string: byte length, then that many UTF-8 bytes
+//   values      the same
+//   integers    per integer: a little-endian qint64
+//   nodes       per node: index of its first child, number of children
+//   children    per child: attribute index, type, then a value index for a
+//               basic value, an integer index for an integer or a node index
+//               for a struct
+//
+// Node 0 is the root. Nodes are written breadth first, so every struct's
+// node comes after its parent's, and each node's children are contiguous.
+namespace Snapshot
+{
+	static const char MAGIC[4] = { 'C', 'C', 'D', 'S' };
+	static const quint32 VERSION = 2;
+
+	static const int HEADER_SIZE = 7 * sizeof(quint32);
+	static const int INTEGER_SIZE = sizeof(qint64);
+	static const int NODE_SIZE = 2 * sizeof(quint32);
+	static const int CHILD_SIZE = 3 * sizeof(quint32);
+
+	enum ChildType {
+		CHILD_BASIC = 1,
+		CHILD_STRUCT = 2,
+		CHILD_INTEGER = 3
+	};
+}
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,283 @@
+//
+// SnapshotReader.cpp
+//
+// Load a data hierarchy saved by SnapshotWriter.
+//
+// (c) 2014 Graham West
+
+// Class header, always comes first.
+#include "SnapshotReader.h"
+
+// System headers.
+#include <string.h>
+
+// Library headers.
+#include <QFile>
+#include <QtEndian>
+
+// Common headers.
+#include "StringDeduplicator.h"
+
+// Application headers.
+#include "Snapshot.h"
+
+SnapshotReader::SnapshotReader() : m_Arena(0)
+{
+}
+
+SnapshotReader::~SnapshotReader()
+{
+}
+
+bool SnapshotReader::IsSnapshot(const QString& fileName)
+{
+	bool retval = false;
+	QFile file(fileName);
+
+	if (file.open(QIODevice::ReadOnly))
+	{
+		char magic[sizeof(Snapshot::MAGIC)];
+
+		if (file.read(magic, sizeof(magic)) == sizeof(magic) &&
+			memcmp(magic, Snapshot::MAGIC, sizeof(magic)) == 0)
+		{
+			retval = true;
+		}
+
+		file.close();
+	}
+
+	return retval;
+}
+
+DataHierarchy* SnapshotReader::Read(const QString& fileName)
+{
+	DataHierarchy* retval = 0;
+	QFile file(fileName);
+
+	if (file.exists() && file.open(QIODevice::ReadOnly))
+	{
+		qint64 fileSize = file.size();
+		uchar* mapped = 0;
+
+		if (fileSize >= Snapshot::HEADER_SIZE)
+		{
+			mapped = file.map(0, fileSize);
+		}
+
+		if (mapped)
+		{
+			retval = Parse(mapped, fileSize);
+			file.unmap(mapped);
+		}
+		else if (fileSize >= Snapshot::HEADER_SIZE)
+		{
+			QByteArray contents = file.readAll();
+			retval = Parse(reinterpret_cast<const uchar*>(contents.constData()),
+				contents.size());
+		}
+
+		file.close();
+	}
+
+	return retval;
+}
+
+DataHierarchy* SnapshotReader::Parse(const uchar* data, qint64 size)
+{
+	const uchar* pos = data;
+	const uchar* end = data + size;
+	quint32 version = 0;
+	quint32 attribCount = 0;
+	quint32 valueCount = 0;
+	quint32 integerCount = 0;
+	quint32 nodeCount = 0;
+	quint32 childCount = 0;
+
+	if (memcmp(pos, Snapshot::MAGIC, sizeof(Snapshot::MAGIC)) != 0)
+	{
+		return 0;
+	}
+
+	pos += sizeof(Snapshot::MAGIC);
+
+	if (!ReadU32(pos, end, version) || version != Snapshot::VERSION ||
+		!ReadU32(pos, end, attribCount) || !ReadU32(pos, end, valueCount) ||
+		!ReadU32(pos, end, integerCount) || !ReadU32(pos, end, nodeCount) ||
+		!ReadU32(pos, end, childCount) ||
+		nodeCount == 0)
+	{
+		return 0;
+	}
+
+	QVector<uint> attribIds;
+	QVector<uint> valueIds;
+
+	if (!ReadStrings(pos, end, attribCount, true, attribIds) ||
+		!ReadStrings(pos, end, valueCount, false, valueIds))
+	{
+		return 0;
+	}
+
+	if (static_cast<qint64>(integerCount) * Snapshot::INTEGER_SIZE > end - pos)
+	{
+		return 0;
+	}
+
+	const uchar* integerTable = pos;
+	pos += static_cast<qint64>(integerCount) * Snapshot::INTEGER_SIZE;
+
+	// Both tables have fixed size records, so check they fit before
+	// trusting any of the counts.
+	const uchar* nodeTable = pos;
+	const uchar* childTable = nodeTable + static_cast<qint64>(nodeCount) * Snapshot::NODE_SIZE;
+
+	if (static_cast<qint64>(nodeCount) * Snapshot::NODE_SIZE +
+		static_cast<qint64>(childCount) * Snapshot::CHILD_SIZE != end - pos)
+	{
+		return 0;
+	}
+
+	// Make every node first, so struct values can be filled in as they are
+	// met. Each node other than the root must be used exactly once, and only
+	// by a node before it, so a damaged file can't produce a loop or a
+	// shared subtree.
+	QVector<DataHierarchy*> nodes(nodeCount);
+	QVector<bool> used(nodeCount, false);
+	bool ok = true;
+
+	for (quint32 count = 0; count < nodeCount; count++)
+	{
+		nodes[count] = DataHierarchy::Create(m_Arena);
+	}
+
+	used[0] = true;
+
+	for (quint32 node = 0; ok && node < nodeCount; node++)
+	{
+		const uchar* nodeRecord = nodeTable + static_cast<qint64>(node) * Snapshot::NODE_SIZE;
+		quint32 firstChild = qFromLittleEndian<quint32>(nodeRecord);
+		quint32 children = qFromLittleEndian<quint32>(nodeRecord + sizeof(quint32));
+
+		if (firstChild > childCount || children > childCount - firstChild)
+		{
+			ok = false;
+		}
+
+		for (quint32 count = 0; ok && count < children; count++)
+		{
+			const uchar* childRecord = childTable +
+				static_cast<qint64>(firstChild + count) * Snapshot::CHILD_SIZE;
+			quint32 attribIndex = qFromLittleEndian<quint32>(childRecord);
+			quint32 type = qFromLittleEndian<quint32>(childRecord + sizeof(quint32));
+			quint32 value = qFromLittleEndian<quint32>(childRecord + 2 * sizeof(quint32));
+
+			if (attribIndex >= attribCount)
+			{
+				ok = false;
+			}
+			else if (type == Snapshot::CHILD_BASIC && value < valueCount)
+			{
+				nodes[node]->Set(attribIds[attribIndex], DataValue(valueIds[value]));
+			}
+			else if (type == Snapshot::CHILD_INTEGER && value < integerCount)
+			{
+				qint64 integerValue = qFromLittleEndian<qint64>(integerTable +
+					static_cast<qint64>(value) * Snapshot::INTEGER_SIZE);
+				nodes[node]->Set(attribIds[attribIndex], DataValue::Integer(integerValue));
+			}
+			else if (type == Snapshot::CHILD_STRUCT && value > node &&
+				value < nodeCount && !used[value])
+			{
+				used[value] = true;
+				nodes[node]->Set(attribIds[attribIndex], DataValue(nodes[value]));
+			}
+			else
+			{
+				ok = false;
+			}
+		}
+	}
+
+	for (quint32 count = 1; ok && count < nodeCount; count++)
+	{
+		ok = used[count];
+	}
+
+	if (!ok)
+	{
+		// Deleting the root only frees the nodes already attached to the
+		// tree, so free the rest by hand.
+		for (quint32 count = 1; count < nodeCount; count++)
+		{
+			if (!used[count])
+			{
+				DataHierarchy::Destroy(nodes[count]);
+			}
+		}
+
+		DataHierarchy::Destroy(nodes[0]);
+		return 0;
+	}
+
+	return nodes[0];
+}
+
+bool SnapshotReader::ReadU32(const uchar*& pos, const uchar* end, quint32& value)
+{
+	bool retval = false;
+
+	if (end - pos >= static_cast<qint64>(sizeof(quint32)))
+	{
+		value = qFromLittleEndian<quint32>(pos);
+		pos += sizeof(quint32);
+		retval = true;
+	}
+
+	return retval;
+}
+
+bool SnapshotReader::ReadStrings(const uchar*& pos, const uchar* end,
+	quint32 count, bool attributes, QVector<uint>& idsDest)
+{
+	// Every string has at least its length, so a count with no room for
+	// them all is rejected before anything is allocated for it.
+	bool retval = (static_cast<qint64>(count) <=
+		(end - pos) / static_cast<qint64>(sizeof(quint32)) && count <= 0x7fffffffu);
+
+	idsDest.clear();
+
+	if (retval)
+	{
+		idsDest.reserve(static_cast<int>(count));
+	}
+
+	for (quint32 index = 0; retval && index < count; index++)
+	{
+		quint32 length = 0;
+
+		if (ReadU32(pos, end, length) && length <= static_cast<quint64>(end - pos))
+		{
+			const char* str = reinterpret_cast<const char*>(pos);
+
+			// Attributes are matched without regard to case, values exactly.
+			// Both are interned straight from their UTF-8 bytes.
+			if (attributes)
+			{
+				idsDest.push_back(StringDeduplicator::StoreNoCase(str, length));
+			}
+			else
+			{
+				idsDest.push_back(StringDeduplicator::Store(str, length));
+			}
+
+			pos += length;
+		}
+		else
+		{
+			retval = false;
+		}
+	}
+
+	return retval;
+}
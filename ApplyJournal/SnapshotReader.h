@@ -0,0 +1,47 @@
+//
+// SnapshotReader.h
+//
+// Load a data hierarchy saved by SnapshotWriter.
+//
+// (c) 2014 Graham West
+
+#if !defined(SNAPSHOTREADER_H)
+#define SNAPSHOTREADER_H
+
+// Library headers.
+#include <QString>
+#include <QVector>
+
+// Application headers.
+#include "DataArena.h"
+#include "DataHierarchy.h"
+
+class SnapshotReader
+{
+public:
+	SnapshotReader();
+	~SnapshotReader();
+
+	// Checks the magic number only, to tell a snapshot from a text file.
+	static bool IsSnapshot(const QString& fileName);
+
+	// Every node read is allocated from the arena, if there is one.
+	inline void Arena(DataArena* newArena) { m_Arena = newArena; }
+	inline DataArena* Arena() const { return m_Arena; }
+
+	DataHierarchy* Read(const QString& fileName);
+
+private:
+	SnapshotReader(const SnapshotReader& src);
+	SnapshotReader& operator=(const SnapshotReader& src);
+
+	DataHierarchy* Parse(const uchar* data, qint64 size);
+
+	static bool ReadU32(const uchar*& pos, const uchar* end, quint32& value);
+	static bool ReadStrings(const uchar*& pos, const uchar* end, quint32 count,
+		bool attributes, QVector<uint>& idsDest);
+
+	DataArena* m_Arena;
+};
+
+#endif // SNAPSHOTREADER_H
@@ -0,0 +1,194 @@
+//
+// SnapshotWriter.cpp
+//
+// Save a data hierarchy in the binary snapshot format, which loads far
+// faster than the text format.
+//
+// (c) 2014 Graham West
+
+// Class header, always comes first.
+#include "SnapshotWriter.h"
+
+// Library headers.
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QVector>
+#include <QtEndian>
+
+// Common headers.
+#include "StringDeduplicator.h"
+
+// Application headers.
+#include "Snapshot.h"
+
+SnapshotWriter::SnapshotWriter()
+{
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+}
+
+bool SnapshotWriter::Write(const DataHierarchy* const hierarchy,
+	const QString& fileName) const
+{
+	bool retval = false;
+
+	if (hierarchy && !fileName.isEmpty())
+	{
+		QVector<quint32> attribIndexes;
+		QVector<quint32> valueIndexes;
+		quint32 attribCount = 0;
+		quint32 valueCount = 0;
+		QHash<qint64, quint32> integerIndexes;
+		QByteArray attribTable;
+		QByteArray valueTable;
+		QByteArray integerTable;
+		QByteArray nodeTable;
+		QByteArray childTable;
+		QVector<const DataHierarchy*> nodes;
+		quint32 childCount = 0;
+
+		// Walk the tree breadth first. A struct's node index is known as
+		// soon as it is queued, so its parent can refer to it straight away.
+		nodes.push_back(hierarchy);
+
+		for (int current = 0; current < nodes.size(); current++)
+		{
+			const DataHierarchy* node = nodes[current];
+			QList<uint> attribIds;
+			node->AllAttributes(attribIds);
+
+			AppendU32(nodeTable, childCount);
+			AppendU32(nodeTable, attribIds.size());
+
+			for (int count = 0; count < attribIds.size(); count++)
+			{
+				DataValue dval = node->Value(attribIds[count]);
+				quint32 attribIndex = 0;
+
+				if (TableIndex(attribIndexes, attribIds[count], attribCount, attribIndex))
+				{
+					AppendString(attribTable,
+						StringDeduplicator::Retrieve(attribIds[count]));
+				}
+
+				if (dval.IsInteger())
+				{
+					quint32 integerIndex = integerIndexes.value(dval.IntegerValue(),
+						integerIndexes.size());
+
+					if (integerIndex == static_cast<quint32>(integerIndexes.size()))
+					{
+						integerIndexes.insert(dval.IntegerValue(), integerIndex);
+						AppendI64(integerTable, dval.IntegerValue());
+					}
+
+					AppendU32(childTable, attribIndex);
+					AppendU32(childTable, Snapshot::CHILD_INTEGER);
+					AppendU32(childTable, integerIndex);
+					childCount++;
+				}
+				else if (dval.IsBasic())
+				{
+					quint32 valueIndex = 0;
+
+					if (TableIndex(valueIndexes, dval.BasicValue(), valueCount, valueIndex))
+					{
+						AppendString(valueTable,
+							StringDeduplicator::Retrieve(dval.BasicValue()));
+					}
+
+					AppendU32(childTable, attribIndex);
+					AppendU32(childTable, Snapshot::CHILD_BASIC);
+					AppendU32(childTable, valueIndex);
+					childCount++;
+				}
+				else if (dval.IsStruct())
+				{
+					AppendU32(childTable, attribIndex);
+					AppendU32(childTable, Snapshot::CHILD_STRUCT);
+					AppendU32(childTable, nodes.size());
+					nodes.push_back(dval.StructValue());
+					childCount++;
+				}
+			}
+		}
+
+		QByteArray header;
+		header.append(Snapshot::MAGIC, sizeof(Snapshot::MAGIC));
+		AppendU32(header, Snapshot::VERSION);
+		AppendU32(header, attribCount);
+		AppendU32(header, valueCount);
+		AppendU32(header, integerIndexes.size());
+		AppendU32(header, nodes.size());
+		AppendU32(header, childCount);
+
+		QFile file(fileName);
+
+		if (file.open(QIODevice::WriteOnly))
+		{
+			retval = (file.write(header) == header.size() &&
+				file.write(attribTable) == attribTable.size() &&
+				file.write(valueTable) == valueTable.size() &&
+				file.write(integerTable) == integerTable.size() &&
+				file.write(nodeTable) == nodeTable.size() &&
+				file.write(childTable) == childTable.size());
+
+			file.close();
+		}
+	}
+
+	return retval;
+}
+
+bool SnapshotWriter::TableIndex(QVector<quint32>& indexes, uint id,
+	quint32& count, quint32& indexDest)
+{
+	bool retval = false;
+
+	// String IDs are dense, so a vector indexed by ID can hold one more
+	// than each string's table index, with 0 for strings not yet added.
+	if (id >= static_cast<uint>(indexes.size()))
+	{
+		int newSize = qMax(static_cast<int>(id), StringDeduplicator::Total()) + 1;
+		indexes.reserve(newSize);
+
+		while (indexes.size() < newSize)
+		{
+			indexes.push_back(0);
+		}
+	}
+
+	if (indexes[id] == 0)
+	{
+		indexes[id] = ++count;
+		retval = true;
+	}
+
+	indexDest = indexes[id] - 1;
+
+	return retval;
+}
+
+void SnapshotWriter::AppendU32(QByteArray& dest, quint32 value)
+{
+	uchar bytes[sizeof(quint32)];
+	qToLittleEndian(value, bytes);
+	dest.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+}
+
+void SnapshotWriter::AppendI64(QByteArray& dest, qint64 value)
+{
+	uchar bytes[sizeof(qint64)];
+	qToLittleEndian(value, bytes);
+	dest.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+}
+
+void SnapshotWriter::AppendString(QByteArray& dest, const InternedString& str)
+{
+	// Interned strings are already UTF-8.
+	AppendU32(dest, str.Length());
+	dest.append(str.Data(), str.Length());
+}
@@ -0,0 +1,45 @@
+//
+// SnapshotWriter.h
+//
+// Save a data hierarchy in the binary snapshot format, which loads far
+// faster than the text format.
+//
+// (c) 2014 Graham West
+
+#if !defined(SNAPSHOTWRITER_H)
+#define SNAPSHOTWRITER_H
+
+// Library headers.
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+// Common headers.
+#include "StringDeduplicator.h"
+
+// Application headers.
+#include "DataHierarchy.h"
+
+class SnapshotWriter
+{
+public:
+	SnapshotWriter();
+	~SnapshotWriter();
+
+	bool Write(const DataHierarchy* const hierarchy, const QString& fileName) const;
+
+private:
+	SnapshotWriter(const SnapshotWriter& src);
+	SnapshotWriter& operator=(const SnapshotWriter& src);
+
+	// Returns true if the ID wasn't in the table yet, and has just been
+	// given the next index.
+	static bool TableIndex(QVector<quint32>& indexes, uint id, quint32& count,
+		quint32& indexDest);
+
+	static void AppendU32(QByteArray& dest, quint32 value);
+	static void AppendI64(QByteArray& dest, qint64 value);
+	static void AppendString(QByteArray& dest, const InternedString& str);
+};
+
+#endif // SNAPSHOTWRITER_H
@@ -3,29 +3,63 @@
 //
 // Read, process, write and replace data files after applying entries from a
 // journal file. The journal and data file names are parsed from command line
-// arguments.
+// arguments. The journal is left where it is, with a checkpoint beside it
+// saying how much of it has been applied.
 //
 // (c) 2014 Graham West
 
 // System headers.
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 // Library headers.
 #include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
 #include <QFileInfo>
+#include <QStringList>
+#include <QThread>
 
 // Common headers.
 #include "ErrorLogger.h"
 #include "StringDeduplicator.h"
 
 // Application headers.
+#include "DataArena.h"
 #include "DataFileTracker.h"
 #include "DataHierarchy.h"
 #include "DataReader.h"
 #include "DataWriter.h"
+#include "JournalCheckpoint.h"
+#include "JournalParser.h"
+#include "JournalWatcher.h"
+#include "SnapshotReader.h"
+#include "SnapshotWriter.h"
+
+// Defaults for how often -follow saves the data files: after this many
+// seconds with lines applied, or this many lines, whichever comes first.
+static const int DEFAULT_FOLLOW_INTERVAL = 60;
+static const int DEFAULT_FOLLOW_LINES = 10000;
+
+// The longest -interval allowed, so that it still fits an int as milliseconds.
+static const int MAX_FOLLOW_INTERVAL = INT_MAX / 1000;
+
+// Lines are compacted this many at a time before they're applied.
+static const int COMPACT_WINDOW = 4096;
 
 static DataFileTracker s_Files;
 
+// Set by SIGINT or SIGTERM, to stop following the journal.
+static volatile sig_atomic_t s_StopFollowing = 0;
+
+static void StopFollowing(int signalNumber)
+{
+	Q_UNUSED(signalNumber);
+	s_StopFollowing = 1;
+}
+
 static QString FullFileName(const QString& relativeName)
 {
 	QFileInfo info(QDir::current(), relativeName);
@@ -39,10 +73,37 @@ static bool ReadFile(const QString& fileName)
 
 	if (!fullName.isEmpty())
 	{
-		DataReader reader;
 		DataHierarchy* hierarchy;
-		
-		hierarchy = reader.Read(fullName);
+
+		// Each file's nodes go in an arena of their own, so the file can be
+		// dropped all at once.
+		DataArena* arena = new DataArena;
+		bool snapshot = SnapshotReader::IsSnapshot(fullName);
+
+		// A binary snapshot loads much faster than the text it came from.
+		if (snapshot)
+		{
+			SnapshotReader reader;
+			reader.Arena(arena);
+			hierarchy = reader.Read(fullName);
+		}
+		else
+		{
+			DataReader reader;
+			reader.Arena(arena);
+
+#if defined(Q_OS_UNIX)
+			// Structs the journal never touches are never parsed, and are
+			// written back out just as they were read, which beats parsing
+			// them on every thread. Their text stays mapped while the file
+			// is replaced, which only Unix allows.
+			reader.Lazy(true);
+#else
+			reader.Threads(QThread::idealThreadCount());
+#endif
+
+			hierarchy = reader.Read(fullName);
+		}
 
 		if (hierarchy)
 		{
@@ -51,17 +112,25 @@ static bool ReadFile(const QString& fileName)
 			if (idVal.IsBasic())
 			{
 				QString id = idVal.BasicString();
-				s_Files.Add(fileName, id, hierarchy);
+				retval = s_Files.Add(fileName, id, hierarchy, arena, snapshot);
+
+				if (!retval)
+				{
+					// XXX: Report duplicate file ID.
+					DataHierarchy::Destroy(hierarchy);
+					delete arena;
+				}
 			}
 			else
 			{
 				// XXX: Report id-less file.
-				delete hierarchy;
+				delete arena;
 			}
 		}
 		else
 		{
 			// XXX: Report unreadable file.
+			delete arena;
 		}
 	}
 	else
@@ -72,16 +141,170 @@ static bool ReadFile(const QString& fileName)
 	return retval;
 }
 
+// Each file is written in the format it was read in.
 static bool WriteFile(const DataFileTracker::FileInfo& info)
 {
 	bool retval = false;
-	DataWriter writer;
 	QString outName = info.fileName + ".new";
-	retval = writer.Write(info.hierarchy, outName, info.loaded);
+
+	if (info.snapshot)
+	{
+		SnapshotWriter writer;
+		retval = writer.Write(info.hierarchy, outName);
+	}
+	else
+	{
+		DataWriter writer;
+		retval = writer.Write(info.hierarchy, outName, info.loaded);
+	}
 
 	return retval;
 }
 
+// Every data file is replaced along with the journal's checkpoint, or none
+// of them are. Once the new checkpoint is renamed to .commit, the .new files
+// are committed to, and any left over by a crash are put in place the next
+// time. Without a .commit they are only a run that didn't finish.
+static bool FinishCommit(const QString& checkpointName, const QStringList& fileNames)
+{
+	bool retval = true;
+
+	if (!QFile::exists(checkpointName + ".commit"))
+	{
+		QFile::remove(checkpointName + ".new");
+
+		for (int count = 0; count < fileNames.count(); count++)
+		{
+			QFile::remove(fileNames[count] + ".new");
+		}
+	}
+	else
+	{
+		// Nothing is deleted until every new file has taken its place.
+		for (int count = 0; retval && count < fileNames.count(); count++)
+		{
+			QString fileName = fileNames[count];
+
+			if (QFile::exists(fileName + ".new"))
+			{
+				QFile::remove(fileName + ".old");
+				retval = ((!QFile::exists(fileName) ||
+					QFile::rename(fileName, fileName + ".old")) &&
+					QFile::rename(fileName + ".new", fileName));
+			}
+		}
+
+		if (retval)
+		{
+			QFile::remove(checkpointName);
+			retval = QFile::rename(checkpointName + ".commit", checkpointName);
+		}
+
+		if (retval)
+		{
+			for (int count = 0; count < fileNames.count(); count++)
+			{
+				QFile::remove(fileNames[count] + ".old");
+			}
+		}
+	}
+
+	return retval;
+}
+
+static bool ReplaceFiles(const QString& checkpointName,
+	const JournalCheckpoint& checkpoint, const DataFileTracker::FilesInfo& files)
+{
+	QStringList fileNames;
+
+	for (int count = 0; count < files.count(); count++)
+	{
+		fileNames.append(files[count].fileName);
+	}
+
+	bool retval = (checkpoint.Write(checkpointName + ".new") &&
+		QFile::rename(checkpointName + ".new", checkpointName + ".commit"));
+
+	if (retval)
+	{
+		retval = FinishCommit(checkpointName, fileNames);
+	}
+
+	return retval;
+}
+
+// Every file is written to a .new file before any is replaced, so a
+// failure part way leaves the current files as they were.
+static bool SaveFiles(const QString& checkpointName, const JournalCheckpoint& checkpoint)
+{
+	bool retval = true;
+	DataFileTracker::FilesInfo files;
+	s_Files.Files(files);
+
+	// A file with a malformed struct that was read lazily has lost the rest
+	// of that struct, and would lose it for good if it were saved.
+	for (int count = 0; retval && count < files.count(); count++)
+	{
+		if (files[count].arena && files[count].arena->Damaged())
+		{
+			SystemLogger.NonFatal("%s has a malformed struct, so it can't be saved",
+				qPrintable(files[count].fileName));
+			retval = false;
+		}
+	}
+
+	for (int count = 0; retval && count < files.count(); count++)
+	{
+		retval = WriteFile(files[count]);
+	}
+
+	if (retval)
+	{
+		retval = ReplaceFiles(checkpointName, checkpoint, files);
+	}
+
+	return retval;
+}
+
+// Strings saved beside the data files last time are loaded before those
+// files are read, so reading them mostly finds strings already stored. The
+// table has to be loaded before anything else is stored.
+static QString StringTableName(const QStringList& fileNames)
+{
+	QFileInfo info(fileNames.first());
+	return info.absoluteDir().filePath("strings.table");
+}
+
+static void LoadStrings(const QString& tableName)
+{
+	if (!StringDeduplicator::Load(tableName))
+	{
+		SystemLogger.Message("No saved string table in %s", qPrintable(tableName));
+	}
+}
+
+// Strings nothing uses any more are dropped first, so the table doesn't grow
+// with every journal applied. The new table is written beside the old one
+// and then takes its place, so a crash part way through saving never leaves
+// a partly written table to be loaded next time.
+static void SaveStrings(const QString& tableName)
+{
+	int dropped = s_Files.Compact();
+
+	SystemLogger.Message("Compaction dropped %d strings, leaving %d",
+		dropped, StringDeduplicator::Total());
+
+	QFile::remove(tableName + ".new");
+
+	if (!StringDeduplicator::Save(tableName + ".new") ||
+		(QFile::exists(tableName) && !QFile::remove(tableName)) ||
+		!QFile::rename(tableName + ".new", tableName))
+	{
+		SystemLogger.Warning("Unable to save string table %s", qPrintable(tableName));
+		QFile::remove(tableName + ".new");
+	}
+}
+
 static int TestApplyJournal()
 {
 	int retval = 0;
@@ -110,6 +333,13 @@ static int TestApplyJournal()
 	ReadFile("../TestData/master.data");
 	ReadFile("../TestData/layer1000.data");
 
+	SystemLogger.Message("Interned %d strings in %lld bytes",
+		StringDeduplicator::Total(), StringDeduplicator::BytesUsed());
+
+	int dropped = s_Files.Compact();
+	SystemLogger.Message("Compaction dropped %d strings, leaving %d in %lld bytes",
+		dropped, StringDeduplicator::Total(), StringDeduplicator::BytesUsed());
+
 	DataFileTracker::FilesInfo files;
 	s_Files.Files(files);
 
@@ -132,27 +362,248 @@ static int ApplyJournal(int argc, char* argv[])
 	else
 	{
 		QString journalName(argv[1]);
-		// Vector of file IDs
+		QString checkpointName = journalName + ".checkpoint";
+		QStringList fileNames;
+
 		for (int count = 2; count < argc; count++)
 		{
-			QString fileName(argv[count]);
-			// Read file by name, get ID
+			fileNames.append(argv[count]);
 		}
-		// Modify files with journal
-		for (int count = 2; count < argc; count++)
+
+		// A run that stopped part way through replacing the files is
+		// finished before they're read.
+		bool ok = FinishCommit(checkpointName, fileNames);
+		bool read = true;
+		bool changed = false;
+		QString tableName = StringTableName(fileNames);
+
+		LoadStrings(tableName);
+
+		for (int count = 0; count < fileNames.count(); count++)
 		{
-			QString fileName(argv[count]);
-			// Write data for ID to .new file
+			read = ReadFile(fileNames[count]) && read;
 		}
 
-		// Rename journal file to .processed
-		// Rename current files to .old and .new to current.
-		// Delete the .old and .processed files.
+		ok = ok && read;
+
+		// The journal is kept, and only what has been added to it since its
+		// checkpoint is applied.
+		JournalCheckpoint checkpoint;
+		checkpoint.Read(checkpointName);
+
+		JournalParser parser(journalName, &s_Files);
+
+		if (ok)
+		{
+			parser.Threads(QThread::idealThreadCount());
+			parser.CompactWindow(COMPACT_WINDOW);
+			parser.Resume(checkpoint);
+			ok = parser.Process();
+			changed = (parser.LinesApplied() > 0);
+		}
+
+		if (ok && !changed)
+		{
+			SystemLogger.Message("Nothing new in %s since line %u",
+				qPrintable(journalName), checkpoint.Line());
+		}
+
+		// The lines before a bad one are still saved, so the next run starts
+		// at the bad line rather than applying them all again.
+		if (changed)
+		{
+			ok = SaveFiles(checkpointName, parser.Checkpoint()) && ok;
+		}
+
+		if (read)
+		{
+			SaveStrings(tableName);
+		}
+
+		retval = ok ? 0 : 1;
 	}
 	
 	return retval;
 }
 
+// Keep the data files loaded and apply each line as it is added to the
+// journal, saving the files every so often, until stopped by a signal or a
+// bad line.
+static int FollowJournal(const QString& journalName, const QStringList& fileNames,
+	int interval, int maxLines)
+{
+	int retval = 0;
+	QString checkpointName = journalName + ".checkpoint";
+	QString tableName = StringTableName(fileNames);
+	bool ok = FinishCommit(checkpointName, fileNames);
+
+	LoadStrings(tableName);
+
+	for (int count = 0; count < fileNames.count(); count++)
+	{
+		ok = ReadFile(fileNames[count]) && ok;
+	}
+
+	if (ok)
+	{
+		JournalCheckpoint saved;
+		JournalCheckpoint current;
+		JournalParser parser(journalName, &s_Files);
+		JournalWatcher watcher(journalName);
+		QElapsedTimer sinceSave;
+		unsigned int unsaved = 0;
+
+		saved.Read(checkpointName);
+		current = saved;
+
+		// A line still being written is left until it's finished.
+		parser.Threads(QThread::idealThreadCount());
+		parser.CompactWindow(COMPACT_WINDOW);
+		parser.CompleteLinesOnly(true);
+
+		signal(SIGINT, StopFollowing);
+		signal(SIGTERM, StopFollowing);
+
+		watcher.Start();
+		sinceSave.start();
+
+		SystemLogger.Message("Following %s from line %u", qPrintable(journalName),
+			saved.Line());
+
+		while (ok && !s_StopFollowing)
+		{
+			// Lines are applied from wherever the last look got to. A journal
+			// that isn't there, while it's being replaced, has nothing yet.
+			if (QFile::exists(journalName))
+			{
+				parser.Resume(current);
+				ok = parser.Process();
+				current = parser.Checkpoint();
+				unsaved += parser.LinesApplied();
+			}
+
+			if (unsaved == 0)
+			{
+				sinceSave.restart();
+			}
+
+			// The lines before a bad one are still saved, before stopping.
+			if (unsaved > 0 && (!ok || s_StopFollowing ||
+				unsaved >= static_cast<unsigned int>(maxLines) ||
+				sinceSave.elapsed() >= interval * 1000LL))
+			{
+				if (SaveFiles(checkpointName, current))
+				{
+					SystemLogger.Message("Saved data files at line %u of %s",
+						current.Line(), qPrintable(journalName));
+
+					saved = current;
+					unsaved = 0;
+					sinceSave.restart();
+
+					// Nothing is parsing between passes, so this is when
+					// strings the lines replaced can be dropped, and the
+					// rest saved for the next start.
+					SaveStrings(tableName);
+				}
+				else
+				{
+					SystemLogger.NonFatal("Unable to save data files at line %u of %s",
+						current.Line(), qPrintable(journalName));
+					ok = false;
+				}
+			}
+
+			// Wake for the next save even if nothing more is written. The
+			// watcher may come back sooner, if it's polling, so that a signal
+			// is noticed; the journal is just looked at again.
+			if (ok && !s_StopFollowing)
+			{
+				qint64 wait = interval * 1000LL;
+
+				if (unsaved > 0)
+				{
+					wait = qMax(wait - sinceSave.elapsed(), 1LL);
+				}
+
+				watcher.Wait(static_cast<int>(wait));
+			}
+		}
+
+		watcher.Stop();
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+	}
+
+	retval = ok ? 0 : 1;
+
+	return retval;
+}
+
+// Counts above maxCount are taken as maxCount.
+static bool ParseCount(const char* arg, int maxCount, int& countDest)
+{
+	char* end = 0;
+	long count = strtol(arg, &end, 10);
+	bool retval = (end != arg && *end == '\0' && count > 0);
+
+	if (retval)
+	{
+		countDest = static_cast<int>(qMin(count, static_cast<long>(maxCount)));
+	}
+
+	return retval;
+}
+
+static int Follow(int argc, char* argv[])
+{
+	int retval = 0;
+	int interval = DEFAULT_FOLLOW_INTERVAL;
+	int maxLines = DEFAULT_FOLLOW_LINES;
+	int arg = 2;
+	bool ok = true;
+
+	while (ok && arg + 1 < argc && argv[arg][0] == '-')
+	{
+		QString option(argv[arg]);
+
+		if (option.compare("-interval", Qt::CaseInsensitive) == 0)
+		{
+			ok = ParseCount(argv[arg + 1], MAX_FOLLOW_INTERVAL, interval);
+		}
+		else if (option.compare("-lines", Qt::CaseInsensitive) == 0)
+		{
+			ok = ParseCount(argv[arg + 1], INT_MAX, maxLines);
+		}
+		else
+		{
+			ok = false;
+		}
+
+		arg += 2;
+	}
+
+	if (!ok || argc - arg < 2)
+	{
+		printf("%s -follow [-interval <seconds>] [-lines <count>] "
+			"<journal file> <data file> [data file] ...\n", argv[0]);
+		retval = 1;
+	}
+	else
+	{
+		QStringList fileNames;
+
+		for (int count = arg + 1; count < argc; count++)
+		{
+			fileNames.append(argv[count]);
+		}
+
+		retval = FollowJournal(argv[arg], fileNames, interval, maxLines);
+	}
+
+	return retval;
+}
+
 int main(int argc, char *argv[])
 {
 	int retval = 0;
@@ -174,9 +625,15 @@ int main(int argc, char *argv[])
 	{
 		retval = TestApplyJournal();
 	}
+	else if (argc > 1 && QString(argv[1]).compare("-follow", Qt::CaseInsensitive) == 0)
+	{
+		retval = Follow(argc, argv);
+	}
 	else if (argc < 3)
 	{
 		printf("%s: <journal file> <data file> [data file] ...\n", argv[0]);
+		printf("%s -follow [-interval <seconds>] [-lines <count>] "
+			"<journal file> <data file> [data file] ...\n", argv[0]);
 		retval = 1;
 	}
 	else
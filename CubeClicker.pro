@@ -13,21 +13,33 @@ CONFIG += console
 CONFIG -= app_bundle
 CONFIG += debug
 
-CONFIG += \
-	ApplyJournal
+# Pick the program to build with qmake "PROGRAM=DataConvert", for
+# example, or "PROGRAM=JournalConvert" or "PROGRAM=JournalCompact". ApplyJournal is built by default.
+isEmpty(PROGRAM) {
+	PROGRAM = ApplyJournal
+}
+
+CONFIG += $$PROGRAM
 
 DESTDIR = bin
 
 # Code that belongs in all targets.
 OBJECTS_DIR = common/build
+INCLUDEPATH += common
 
 HEADERS = \
+	common/Checksum.h \
+	common/DelimiterScanner.h \
 	common/ErrorLogger.h \
+	common/LineReader.h \
 	common/StringDeduplicator.h \
 	common/StringUtils.h
 
 SOURCES = \
+	common/Checksum.cpp \
+	common/DelimiterScanner.cpp \
 	common/ErrorLogger.cpp \
+	common/LineReader.cpp \
 	common/StringDeduplicator.cpp \
 	common/StringUtils.cpp
 
@@ -37,18 +49,130 @@ ApplyJournal {
 	OBJECTS_DIR = ApplyJournal/build
 
 	HEADERS += \
+		ApplyJournal/BinaryJournal.h \
+		ApplyJournal/DataArena.h \
 		ApplyJournal/DataFileTracker.h \
 		ApplyJournal/DataHierarchy.h \
 		ApplyJournal/DataReader.h \
+		ApplyJournal/DataSource.h \
 		ApplyJournal/DataWriter.h \
-		ApplyJournal/JournalParser.h
+		ApplyJournal/JournalCheckpoint.h \
+		ApplyJournal/JournalCompactor.h \
+		ApplyJournal/JournalParser.h \
+		ApplyJournal/JournalWatcher.h \
+		ApplyJournal/JournalWriter.h \
+		ApplyJournal/PathCache.h \
+		ApplyJournal/Snapshot.h \
+		ApplyJournal/SnapshotReader.h \
+		ApplyJournal/SnapshotWriter.h
 
 	SOURCES += \
 		ApplyJournal/main.cpp \
+		ApplyJournal/DataArena.cpp \
 		ApplyJournal/DataFileTracker.cpp \
 		ApplyJournal/DataHierarchy.cpp \
 		ApplyJournal/DataReader.cpp \
+		ApplyJournal/DataSource.cpp \
+		ApplyJournal/DataWriter.cpp \
+		ApplyJournal/JournalCheckpoint.cpp \
+		ApplyJournal/JournalCompactor.cpp \
+		ApplyJournal/JournalParser.cpp \
+		ApplyJournal/JournalWatcher.cpp \
+		ApplyJournal/JournalWriter.cpp \
+		ApplyJournal/PathCache.cpp \
+		ApplyJournal/SnapshotReader.cpp \
+		ApplyJournal/SnapshotWriter.cpp
+}
+
+DataConvert {
+	TARGET = DataConvert
+
+	OBJECTS_DIR = DataConvert/build
+	INCLUDEPATH += ApplyJournal
+
+	HEADERS += \
+		ApplyJournal/DataArena.h \
+		ApplyJournal/DataHierarchy.h \
+		ApplyJournal/DataReader.h \
+		ApplyJournal/DataSource.h \
+		ApplyJournal/DataWriter.h \
+		ApplyJournal/Snapshot.h \
+		ApplyJournal/SnapshotReader.h \
+		ApplyJournal/SnapshotWriter.h
+
+	SOURCES += \
+		DataConvert/main.cpp \
+		ApplyJournal/DataArena.cpp \
+		ApplyJournal/DataHierarchy.cpp \
+		ApplyJournal/DataReader.cpp \
+		ApplyJournal/DataSource.cpp \
 		ApplyJournal/DataWriter.cpp \
-		ApplyJournal/JournalParser.cpp
+		ApplyJournal/SnapshotReader.cpp \
+		ApplyJournal/SnapshotWriter.cpp
+}
+
+JournalConvert {
+	TARGET = JournalConvert
+
+	OBJECTS_DIR = JournalConvert/build
+	INCLUDEPATH += ApplyJournal
+
+	HEADERS += \
+		ApplyJournal/BinaryJournal.h \
+		ApplyJournal/DataArena.h \
+		ApplyJournal/DataFileTracker.h \
+		ApplyJournal/DataHierarchy.h \
+		ApplyJournal/DataReader.h \
+		ApplyJournal/DataSource.h \
+		ApplyJournal/JournalCheckpoint.h \
+		ApplyJournal/JournalCompactor.h \
+		ApplyJournal/JournalParser.h \
+		ApplyJournal/JournalWriter.h \
+		ApplyJournal/PathCache.h
+
+	SOURCES += \
+		JournalConvert/main.cpp \
+		ApplyJournal/DataArena.cpp \
+		ApplyJournal/DataFileTracker.cpp \
+		ApplyJournal/DataHierarchy.cpp \
+		ApplyJournal/DataReader.cpp \
+		ApplyJournal/DataSource.cpp \
+		ApplyJournal/JournalCheckpoint.cpp \
+		ApplyJournal/JournalCompactor.cpp \
+		ApplyJournal/JournalParser.cpp \
+		ApplyJournal/JournalWriter.cpp \
+		ApplyJournal/PathCache.cpp
 }
 
+JournalCompact {
+	TARGET = JournalCompact
+
+	OBJECTS_DIR = JournalCompact/build
+	INCLUDEPATH += ApplyJournal
+
+	HEADERS += \
+		ApplyJournal/BinaryJournal.h \
+		ApplyJournal/DataArena.h \
+		ApplyJournal/DataFileTracker.h \
+		ApplyJournal/DataHierarchy.h \
+		ApplyJournal/DataReader.h \
+		ApplyJournal/DataSource.h \
+		ApplyJournal/JournalCheckpoint.h \
+		ApplyJournal/JournalCompactor.h \
+		ApplyJournal/JournalParser.h \
+		ApplyJournal/JournalWriter.h \
+		ApplyJournal/PathCache.h
+
+	SOURCES += \
+		JournalCompact/main.cpp \
+		ApplyJournal/DataArena.cpp \
+		ApplyJournal/DataFileTracker.cpp \
+		ApplyJournal/DataHierarchy.cpp \
+		ApplyJournal/DataReader.cpp \
+		ApplyJournal/DataSource.cpp \
+		ApplyJournal/JournalCheckpoint.cpp \
+		ApplyJournal/JournalCompactor.cpp \
+		ApplyJournal/JournalParser.cpp \
+		ApplyJournal/JournalWriter.cpp \
+		ApplyJournal/PathCache.cpp
+}
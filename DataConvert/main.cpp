@@ -0,0 +1,107 @@
+//
+// main.cpp
+//
+// Convert a data file between the text format and the binary snapshot
+// format. The direction is picked from the input file, and the file names
+// are parsed from command line arguments.
+//
+// (c) 2014 Graham West
+
+// System headers.
+#include <stdio.h>
+
+// Library headers.
+#include <QDateTime>
+#include <QThread>
+
+// Common headers.
+#include "ErrorLogger.h"
+#include "StringDeduplicator.h"
+
+// Application headers.
+#include "DataArena.h"
+#include "DataHierarchy.h"
+#include "DataReader.h"
+#include "DataWriter.h"
+#include "SnapshotReader.h"
+#include "SnapshotWriter.h"
+
+static int Convert(const QString& inName, const QString& outName)
+{
+	int retval = 0;
+	DataHierarchy* hierarchy = 0;
+	bool toText = SnapshotReader::IsSnapshot(inName);
+
+	// Everything read is freed with the arena, in a few large blocks.
+	DataArena arena;
+
+	if (toText)
+	{
+		SnapshotReader reader;
+		reader.Arena(&arena);
+		hierarchy = reader.Read(inName);
+	}
+	else
+	{
+		DataReader reader;
+		reader.Threads(QThread::idealThreadCount());
+		reader.Arena(&arena);
+		hierarchy = reader.Read(inName);
+	}
+
+	if (!hierarchy)
+	{
+		SystemLogger.NonFatal("Unable to read %s", inName.toUtf8().constData());
+		printf("Unable to read %s\n", inName.toUtf8().constData());
+		retval = 2;
+	}
+	else
+	{
+		bool written = false;
+
+		SystemLogger.Message("Interned %d strings in %lld bytes",
+			StringDeduplicator::Total(), StringDeduplicator::BytesUsed());
+
+		if (toText)
+		{
+			DataWriter writer;
+			written = writer.Write(hierarchy, outName, QDateTime::currentDateTime());
+		}
+		else
+		{
+			SnapshotWriter writer;
+			written = writer.Write(hierarchy, outName);
+		}
+
+		if (!written)
+		{
+			SystemLogger.NonFatal("Unable to write %s", outName.toUtf8().constData());
+			printf("Unable to write %s\n", outName.toUtf8().constData());
+			retval = 3;
+		}
+	}
+
+	return retval;
+}
+
+int main(int argc, char *argv[])
+{
+	int retval = 0;
+
+	SystemLogger.Start("../Logs/DataConvert.log", "DataConvert v0.0");
+
+	if (argc != 3)
+	{
+		printf("%s: <input file> <output file>\n", argv[0]);
+		printf("A text input is written as a snapshot, and a snapshot as text.\n");
+		retval = 1;
+	}
+	else
+	{
+		retval = Convert(QString::fromLocal8Bit(argv[1]), QString::fromLocal8Bit(argv[2]));
+	}
+
+	SystemLogger.Stop("DataConvert v0.0");
+
+	return retval;
+}
@@ -0,0 +1,134 @@
+//
+// main.cpp
+//
+// Write a journal out again without the updates that later lines overwrite,
+// so it applies with far fewer changes to the data files. The window size,
+// output format and file names are parsed from command line arguments.
+//
+// (c) 2014 Graham West
+
+// System headers.
+#include <stdio.h>
+#include <stdlib.h>
+
+// Library headers.
+#include <QString>
+#include <QThread>
+
+// Common headers.
+#include "ErrorLogger.h"
+
+// Application headers.
+#include "JournalParser.h"
+#include "JournalWriter.h"
+
+// Without the data files to hand, lines are only compacted against each
+// other, so a bigger window than applying uses costs nothing but memory.
+static const int DEFAULT_WINDOW = 64 * 1024;
+
+static int Compact(const QString& inName, const QString& outName, int window,
+	JournalWriter::Format format)
+{
+	int retval = 0;
+	JournalWriter writer(format);
+
+	// The data files end up the same from either journal, as long as the
+	// original applies without error. If it doesn't, the compacted one
+	// still stops at an error, but perhaps after applying a little more.
+	JournalParser parser(inName, 0);
+	parser.Threads(QThread::idealThreadCount());
+	parser.CompactWindow(window);
+
+	if (!writer.Open(outName))
+	{
+		SystemLogger.NonFatal("Unable to write %s", outName.toUtf8().constData());
+		printf("Unable to write %s\n", outName.toUtf8().constData());
+		retval = 3;
+	}
+	else if (!parser.Convert(writer))
+	{
+		writer.Close();
+
+		SystemLogger.NonFatal("Unable to read %s", inName.toUtf8().constData());
+		printf("Unable to read %s\n", inName.toUtf8().constData());
+		retval = 2;
+	}
+	else if (!writer.Close())
+	{
+		SystemLogger.NonFatal("Unable to write %s", outName.toUtf8().constData());
+		printf("Unable to write %s\n", outName.toUtf8().constData());
+		retval = 3;
+	}
+	else
+	{
+		SystemLogger.Message("Dropped %lld overwritten updates from %s",
+			parser.UpdatesDropped(), inName.toUtf8().constData());
+	}
+
+	return retval;
+}
+
+int main(int argc, char *argv[])
+{
+	int retval = 0;
+	int window = DEFAULT_WINDOW;
+	int arg = 1;
+	bool ok = true;
+	bool formatGiven = false;
+	JournalWriter::Format format = JournalWriter::FORMAT_TEXT;
+
+	SystemLogger.Start("../Logs/JournalCompact.log", "JournalCompact v0.0");
+
+	while (ok && arg < argc && argv[arg][0] == '-')
+	{
+		QString option(argv[arg]);
+
+		if (option.compare("-text", Qt::CaseInsensitive) == 0)
+		{
+			format = JournalWriter::FORMAT_TEXT;
+			formatGiven = true;
+		}
+		else if (option.compare("-binary", Qt::CaseInsensitive) == 0)
+		{
+			format = JournalWriter::FORMAT_BINARY;
+			formatGiven = true;
+		}
+		else if (option.compare("-window", Qt::CaseInsensitive) == 0 && arg + 1 < argc)
+		{
+			char* end = 0;
+			long lines = strtol(argv[++arg], &end, 10);
+
+			ok = (*end == '\0' && lines > 1 && lines <= 0x7fffffffL);
+			window = static_cast<int>(lines);
+		}
+		else
+		{
+			ok = false;
+		}
+
+		arg++;
+	}
+
+	if (!ok || argc - arg != 2)
+	{
+		printf("%s: [-window <lines>] [-text | -binary] <input journal> <output journal>\n",
+			argv[0]);
+		printf("The output is in the input's format unless one is given.\n");
+		retval = 1;
+	}
+	else
+	{
+		QString inName = QString::fromLocal8Bit(argv[arg]);
+
+		if (!formatGiven && JournalParser::IsBinary(inName))
+		{
+			format = JournalWriter::FORMAT_BINARY;
+		}
+
+		retval = Compact(inName, QString::fromLocal8Bit(argv[arg + 1]), window, format);
+	}
+
+	SystemLogger.Stop("JournalCompact v0.0");
+
+	return retval;
+}
@@ -0,0 +1,77 @@
+//
+// main.cpp
+//
+// Convert a journal between the text format and the binary format. The
+// direction is picked from the input file, and the file names are parsed
+// from command line arguments.
+//
+// (c) 2014 Graham West
+
+// System headers.
+#include <stdio.h>
+
+// Library headers.
+#include <QThread>
+
+// Common headers.
+#include "ErrorLogger.h"
+
+// Application headers.
+#include "JournalParser.h"
+#include "JournalWriter.h"
+
+static int Convert(const QString& inName, const QString& outName)
+{
+	int retval = 0;
+	bool toText = JournalParser::IsBinary(inName);
+	JournalWriter writer(toText ? JournalWriter::FORMAT_TEXT : JournalWriter::FORMAT_BINARY);
+
+	// Lines are only read and written again, so no data files are needed.
+	JournalParser parser(inName, 0);
+	parser.Threads(QThread::idealThreadCount());
+
+	if (!writer.Open(outName))
+	{
+		SystemLogger.NonFatal("Unable to write %s", outName.toUtf8().constData());
+		printf("Unable to write %s\n", outName.toUtf8().constData());
+		retval = 3;
+	}
+	else if (!parser.Convert(writer))
+	{
+		writer.Close();
+
+		SystemLogger.NonFatal("Unable to read %s", inName.toUtf8().constData());
+		printf("Unable to read %s\n", inName.toUtf8().constData());
+		retval = 2;
+	}
+	else if (!writer.Close())
+	{
+		SystemLogger.NonFatal("Unable to write %s", outName.toUtf8().constData());
+		printf("Unable to write %s\n", outName.toUtf8().constData());
+		retval = 3;
+	}
+
+	return retval;
+}
+
+int main(int argc, char *argv[])
+{
+	int retval = 0;
+
+	SystemLogger.Start("../Logs/JournalConvert.log", "JournalConvert v0.0");
+
+	if (argc != 3)
+	{
+		printf("%s: <input journal> <output journal>\n", argv[0]);
+		printf("A text journal is written as binary, and a binary one as text.\n");
+		retval = 1;
+	}
+	else
+	{
+		retval = Convert(QString::fromLocal8Bit(argv[1]), QString::fromLocal8Bit(argv[2]));
+	}
+
+	SystemLogger.Stop("JournalConvert v0.0");
+
+	return retval;
+}
@@ -0,0 +1,205 @@
+//
+// Checksum.h
+//
+// Checksums for verifying journal lines and other data.
+//
+// (c) 2014 Graham West
+
+// Class header, always comes first.
+#include "Checksum.h"
+
+// System headers.
+#include <string.h>
+
+// The instruction is used through a function built for SSE4.2 alone, and
+// only called once the CPU has been found to support it, so the rest of the
+// program needs no special flags.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CHECKSUM_SSE42
+#include <nmmintrin.h>
+#endif
+
+// Table k gives the effect on the CRC of a byte followed by k zero bytes,
+// so sixteen bytes can be folded in with sixteen independent lookups, and
+// the tables still fit in 8K. Filled in before main, so threads can share
+// them without locking.
+static const int SLICES = 16;
+static quint16 s_Crc16Tables[SLICES][256];
+
+static bool MakeCrc16Tables()
+{
+	// The CCITT polynomial, bit reversed, as qChecksum uses it.
+	const quint16 poly = 0x8408;
+
+	for (int byte = 0; byte < 256; byte++)
+	{
+		quint16 crc = static_cast<quint16>(byte);
+
+		for (int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 1) ? ((crc >> 1) ^ poly) : (crc >> 1);
+		}
+
+		s_Crc16Tables[0][byte] = crc;
+	}
+
+	for (int slice = 1; slice < SLICES; slice++)
+	{
+		for (int byte = 0; byte < 256; byte++)
+		{
+			quint16 prev = s_Crc16Tables[slice - 1][byte];
+			s_Crc16Tables[slice][byte] = (prev >> 8) ^ s_Crc16Tables[0][prev & 0xff];
+		}
+	}
+
+	return true;
+}
+
+static const bool s_Crc16TablesMade = MakeCrc16Tables();
+
+quint16 Checksum::Crc16(const char* data, int length)
+{
+	const uchar* pos = reinterpret_cast<const uchar*>(data);
+	const uchar* end = pos + length;
+	uint crc = 0xffff;
+
+	// The CRC only covers the first two bytes of each sixteen, which is
+	// where it's folded in; the rest go through their tables as they are.
+	while (end - pos >= SLICES)
+	{
+		crc = s_Crc16Tables[15][(crc ^ pos[0]) & 0xff] ^
+			s_Crc16Tables[14][((crc >> 8) ^ pos[1]) & 0xff] ^
+			s_Crc16Tables[13][pos[2]] ^ s_Crc16Tables[12][pos[3]] ^
+			s_Crc16Tables[11][pos[4]] ^ s_Crc16Tables[10][pos[5]] ^
+			s_Crc16Tables[9][pos[6]] ^ s_Crc16Tables[8][pos[7]] ^
+			s_Crc16Tables[7][pos[8]] ^ s_Crc16Tables[6][pos[9]] ^
+			s_Crc16Tables[5][pos[10]] ^ s_Crc16Tables[4][pos[11]] ^
+			s_Crc16Tables[3][pos[12]] ^ s_Crc16Tables[2][pos[13]] ^
+			s_Crc16Tables[1][pos[14]] ^ s_Crc16Tables[0][pos[15]];
+
+		pos += SLICES;
+	}
+
+	while (pos < end)
+	{
+		crc = (crc >> 8) ^ s_Crc16Tables[0][(crc ^ *pos++) & 0xff];
+	}
+
+	return static_cast<quint16>(~crc & 0xffff);
+}
+
+// The same slicing for CRC-32C, eight bytes at a time, for CPUs without the
+// instruction.
+static const int CRC32C_SLICES = 8;
+static quint32 s_Crc32cTables[CRC32C_SLICES][256];
+
+static bool MakeCrc32cTables()
+{
+	// The Castagnoli polynomial, bit reversed.
+	const quint32 poly = 0x82F63B78;
+
+	for (int byte = 0; byte < 256; byte++)
+	{
+		quint32 crc = static_cast<quint32>(byte);
+
+		for (int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 1) ? ((crc >> 1) ^ poly) : (crc >> 1);
+		}
+
+		s_Crc32cTables[0][byte] = crc;
+	}
+
+	for (int slice = 1; slice < CRC32C_SLICES; slice++)
+	{
+		for (int byte = 0; byte < 256; byte++)
+		{
+			quint32 prev = s_Crc32cTables[slice - 1][byte];
+			s_Crc32cTables[slice][byte] = (prev >> 8) ^ s_Crc32cTables[0][prev & 0xff];
+		}
+	}
+
+	return true;
+}
+
+static const bool s_Crc32cTablesMade = MakeCrc32cTables();
+
+static quint32 Crc32cTables(const uchar* pos, const uchar* end, quint32 crc)
+{
+	while (end - pos >= CRC32C_SLICES)
+	{
+		quint32 low = crc ^ (pos[0] | (pos[1] << 8) | (pos[2] << 16) |
+			(static_cast<quint32>(pos[3]) << 24));
+
+		crc = s_Crc32cTables[7][low & 0xff] ^
+			s_Crc32cTables[6][(low >> 8) & 0xff] ^
+			s_Crc32cTables[5][(low >> 16) & 0xff] ^
+			s_Crc32cTables[4][low >> 24] ^
+			s_Crc32cTables[3][pos[4]] ^ s_Crc32cTables[2][pos[5]] ^
+			s_Crc32cTables[1][pos[6]] ^ s_Crc32cTables[0][pos[7]];
+
+		pos += CRC32C_SLICES;
+	}
+
+	while (pos < end)
+	{
+		crc = (crc >> 8) ^ s_Crc32cTables[0][(crc ^ *pos++) & 0xff];
+	}
+
+	return crc;
+}
+
+#if defined(CHECKSUM_SSE42)
+__attribute__((target("sse4.2")))
+static quint32 Crc32cSse42(const uchar* pos, const uchar* end, quint32 crc)
+{
+	quint64 crc64 = crc;
+
+	while (end - pos >= 8)
+	{
+		quint64 word;
+		memcpy(&word, pos, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+		pos += 8;
+	}
+
+	crc = static_cast<quint32>(crc64);
+
+	while (pos < end)
+	{
+		crc = _mm_crc32_u8(crc, *pos++);
+	}
+
+	return crc;
+}
+
+static bool HaveSse42()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+
+static const bool s_HaveSse42 = HaveSse42();
+#endif
+
+quint32 Checksum::Crc32c(const char* data, int length)
+{
+	const uchar* pos = reinterpret_cast<const uchar*>(data);
+	const uchar* end = pos + length;
+	quint32 crc = 0xffffffff;
+
+#if defined(CHECKSUM_SSE42)
+	if (s_HaveSse42)
+	{
+		crc = Crc32cSse42(pos, end, crc);
+	}
+	else
+	{
+		crc = Crc32cTables(pos, end, crc);
+	}
+#else
+	crc = Crc32cTables(pos, end, crc);
+#endif
+
+	return ~crc;
+}
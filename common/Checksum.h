@@ -0,0 +1,31 @@
+//
+// Checksum.h
+//
+// Checksums for verifying journal lines and other data.
+//
+// (c) 2014 Graham West
+
+#if !defined(CHECKSUM_H)
+#define CHECKSUM_H
+
+// Library headers.
+#include <QtGlobal>
+
+class Checksum
+{
+public:
+	// CRC-16/X.25, giving exactly the same result as qChecksum, but sixteen
+	// bytes at a time rather than four bits.
+	static quint16 Crc16(const char* data, int length);
+
+	// CRC-32C (Castagnoli). Uses the SSE4.2 crc32 instruction, eight bytes
+	// at a time, where the CPU has it, and tables where it doesn't.
+	static quint32 Crc32c(const char* data, int length);
+
+private:
+	Checksum();
+	Checksum(const Checksum& src);
+	Checksum& operator=(const Checksum& src);
+};
+
+#endif // CHECKSUM_H
@@ -0,0 +1,398 @@
+//
+// DelimiterScanner.cpp
+//
+// Find the next character that could end or change the meaning of a term,
+// checking many characters at a time where the CPU allows it.
+//
+// (c) 2014 Graham West
+
+// Class header, always comes first.
+#include "DelimiterScanner.h"
+
+// The vector kernels need GCC or Clang on x86. SSE2 is always there on
+// x86-64; AVX2 is only used if the CPU reports it at runtime.
+#if defined(__GNUC__) && defined(__SSE2__) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define DELIMITERSCANNER_X86 1
+#include <immintrin.h>
+#endif
+
+typedef const ushort* (*ScanFunction)(const ushort* begin, const ushort* end);
+typedef const char* (*ByteScanFunction)(const char* begin, const char* end);
+
+// One set of kernels is picked for the CPU when the program starts.
+typedef struct ScanKernels {
+	ScanFunction nextSpecial;
+	ScanFunction nextQuoteOrEscape;
+	ByteScanFunction nextSpecialByte;
+	ByteScanFunction nextQuoteOrEscapeByte;
+	const char* name;
+} ScanKernels;
+
+// Printable ASCII characters that end or change the meaning of a term.
+static inline bool IsSpecialAscii(ushort ch)
+{
+	return (ch == '#' || ch == '{' || ch == '}' || ch == '=' || ch == '"' ||
+		ch == '\\' || ch == '.');
+}
+
+static inline bool IsSpecial(ushort ch)
+{
+	return (ch <= 0x20 || ch >= 0x80 || IsSpecialAscii(ch));
+}
+
+static const ushort* ScalarNextSpecial(const ushort* begin, const ushort* end)
+{
+	while (begin < end && !IsSpecial(*begin))
+	{
+		begin++;
+	}
+
+	return begin;
+}
+
+static const ushort* ScalarNextQuoteOrEscape(const ushort* begin,
+	const ushort* end)
+{
+	while (begin < end && *begin != '"' && *begin != '\\')
+	{
+		begin++;
+	}
+
+	return begin;
+}
+
+static const char* ScalarNextSpecial(const char* begin, const char* end)
+{
+	while (begin < end && !IsSpecial(static_cast<uchar>(*begin)))
+	{
+		begin++;
+	}
+
+	return begin;
+}
+
+static const char* ScalarNextQuoteOrEscape(const char* begin, const char* end)
+{
+	while (begin < end && *begin != '"' && *begin != '\\')
+	{
+		begin++;
+	}
+
+	return begin;
+}
+
+#if defined(DELIMITERSCANNER_X86)
+
+static const ushort* Sse2NextSpecial(const ushort* begin, const ushort* end)
+{
+	const __m128i hash = _mm_set1_epi16('#');
+	const __m128i open = _mm_set1_epi16('{');
+	const __m128i close = _mm_set1_epi16('}');
+	const __m128i equals = _mm_set1_epi16('=');
+	const __m128i quote = _mm_set1_epi16('"');
+	const __m128i escape = _mm_set1_epi16('\\');
+	const __m128i dot = _mm_set1_epi16('.');
+	const __m128i firstPrintable = _mm_set1_epi16(0x21);
+	const __m128i lastAscii = _mm_set1_epi16(0x7f);
+
+	while (end - begin >= 8)
+	{
+		__m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+		__m128i found = _mm_cmpeq_epi16(chars, hash);
+		found = _mm_or_si128(found, _mm_cmpeq_epi16(chars, open));
+		found = _mm_or_si128(found, _mm_cmpeq_epi16(chars, close));
+		found = _mm_or_si128(found, _mm_cmpeq_epi16(chars, equals));
+		found = _mm_or_si128(found, _mm_cmpeq_epi16(chars, quote));
+		found = _mm_or_si128(found, _mm_cmpeq_epi16(chars, escape));
+		found = _mm_or_si128(found, _mm_cmpeq_epi16(chars, dot));
+
+		// The compares are signed, so 0x8000 and up count as "less than
+		// 0x21" rather than "greater than 0x7f". Either way they're found.
+		found = _mm_or_si128(found, _mm_cmplt_epi16(chars, firstPrintable));
+		found = _mm_or_si128(found, _mm_cmpgt_epi16(chars, lastAscii));
+
+		int mask = _mm_movemask_epi8(found);
+
+		if (mask != 0)
+		{
+			// Two mask bits per 16-bit character.
+			return begin + (__builtin_ctz(mask) >> 1);
+		}
+
+		begin += 8;
+	}
+
+	return ScalarNextSpecial(begin, end);
+}
+
+static const ushort* Sse2NextQuoteOrEscape(const ushort* begin,
+	const ushort* end)
+{
+	const __m128i quote = _mm_set1_epi16('"');
+	const __m128i escape = _mm_set1_epi16('\\');
+
+	while (end - begin >= 8)
+	{
+		__m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+		__m128i found = _mm_or_si128(_mm_cmpeq_epi16(chars, quote),
+			_mm_cmpeq_epi16(chars, escape));
+		int mask = _mm_movemask_epi8(found);
+
+		if (mask != 0)
+		{
+			return begin + (__builtin_ctz(mask) >> 1);
+		}
+
+		begin += 8;
+	}
+
+	return ScalarNextQuoteOrEscape(begin, end);
+}
+
+static const char* Sse2NextSpecial(const char* begin, const char* end)
+{
+	const __m128i hash = _mm_set1_epi8('#');
+	const __m128i open = _mm_set1_epi8('{');
+	const __m128i close = _mm_set1_epi8('}');
+	const __m128i equals = _mm_set1_epi8('=');
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i escape = _mm_set1_epi8('\\');
+	const __m128i dot = _mm_set1_epi8('.');
+	const __m128i firstPrintable = _mm_set1_epi8(0x21);
+
+	while (end - begin >= 16)
+	{
+		__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+		__m128i found = _mm_cmpeq_epi8(bytes, hash);
+		found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, open));
+		found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, close));
+		found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, equals));
+		found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, quote));
+		found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, escape));
+		found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, dot));
+
+		// Signed compare, so bytes from 0x80 up are negative and caught
+		// along with whitespace and control characters.
+		found = _mm_or_si128(found, _mm_cmplt_epi8(bytes, firstPrintable));
+
+		int mask = _mm_movemask_epi8(found);
+
+		if (mask != 0)
+		{
+			return begin + __builtin_ctz(mask);
+		}
+
+		begin += 16;
+	}
+
+	return ScalarNextSpecial(begin, end);
+}
+
+static const char* Sse2NextQuoteOrEscape(const char* begin, const char* end)
+{
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i escape = _mm_set1_epi8('\\');
+
+	while (end - begin >= 16)
+	{
+		__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+		__m128i found = _mm_or_si128(_mm_cmpeq_epi8(bytes, quote),
+			_mm_cmpeq_epi8(bytes, escape));
+		int mask = _mm_movemask_epi8(found);
+
+		if (mask != 0)
+		{
+			return begin + __builtin_ctz(mask);
+		}
+
+		begin += 16;
+	}
+
+	return ScalarNextQuoteOrEscape(begin, end);
+}
+
+__attribute__((target("avx2")))
+static const ushort* Avx2NextSpecial(const ushort* begin, const ushort* end)
+{
+	const __m256i hash = _mm256_set1_epi16('#');
+	const __m256i open = _mm256_set1_epi16('{');
+	const __m256i close = _mm256_set1_epi16('}');
+	const __m256i equals = _mm256_set1_epi16('=');
+	const __m256i quote = _mm256_set1_epi16('"');
+	const __m256i escape = _mm256_set1_epi16('\\');
+	const __m256i dot = _mm256_set1_epi16('.');
+	const __m256i firstPrintable = _mm256_set1_epi16(0x21);
+	const __m256i lastAscii = _mm256_set1_epi16(0x7f);
+
+	while (end - begin >= 16)
+	{
+		__m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+		__m256i found = _mm256_cmpeq_epi16(chars, hash);
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi16(chars, open));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi16(chars, close));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi16(chars, equals));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi16(chars, quote));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi16(chars, escape));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi16(chars, dot));
+		found = _mm256_or_si256(found, _mm256_cmpgt_epi16(firstPrintable, chars));
+		found = _mm256_or_si256(found, _mm256_cmpgt_epi16(chars, lastAscii));
+
+		uint mask = static_cast<uint>(_mm256_movemask_epi8(found));
+
+		if (mask != 0)
+		{
+			return begin + (__builtin_ctz(mask) >> 1);
+		}
+
+		begin += 16;
+	}
+
+	return Sse2NextSpecial(begin, end);
+}
+
+__attribute__((target("avx2")))
+static const ushort* Avx2NextQuoteOrEscape(const ushort* begin,
+	const ushort* end)
+{
+	const __m256i quote = _mm256_set1_epi16('"');
+	const __m256i escape = _mm256_set1_epi16('\\');
+
+	while (end - begin >= 16)
+	{
+		__m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+		__m256i found = _mm256_or_si256(_mm256_cmpeq_epi16(chars, quote),
+			_mm256_cmpeq_epi16(chars, escape));
+		uint mask = static_cast<uint>(_mm256_movemask_epi8(found));
+
+		if (mask != 0)
+		{
+			return begin + (__builtin_ctz(mask) >> 1);
+		}
+
+		begin += 16;
+	}
+
+	return Sse2NextQuoteOrEscape(begin, end);
+}
+
+__attribute__((target("avx2")))
+static const char* Avx2NextSpecial(const char* begin, const char* end)
+{
+	const __m256i hash = _mm256_set1_epi8('#');
+	const __m256i open = _mm256_set1_epi8('{');
+	const __m256i close = _mm256_set1_epi8('}');
+	const __m256i equals = _mm256_set1_epi8('=');
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i escape = _mm256_set1_epi8('\\');
+	const __m256i dot = _mm256_set1_epi8('.');
+	const __m256i firstPrintable = _mm256_set1_epi8(0x21);
+
+	while (end - begin >= 32)
+	{
+		__m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+		__m256i found = _mm256_cmpeq_epi8(bytes, hash);
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, open));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, close));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, equals));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, quote));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, escape));
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(bytes, dot));
+		found = _mm256_or_si256(found, _mm256_cmpgt_epi8(firstPrintable, bytes));
+
+		uint mask = static_cast<uint>(_mm256_movemask_epi8(found));
+
+		if (mask != 0)
+		{
+			return begin + __builtin_ctz(mask);
+		}
+
+		begin += 32;
+	}
+
+	return Sse2NextSpecial(begin, end);
+}
+
+__attribute__((target("avx2")))
+static const char* Avx2NextQuoteOrEscape(const char* begin, const char* end)
+{
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i escape = _mm256_set1_epi8('\\');
+
+	while (end - begin >= 32)
+	{
+		__m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+		__m256i found = _mm256_or_si256(_mm256_cmpeq_epi8(bytes, quote),
+			_mm256_cmpeq_epi8(bytes, escape));
+		uint mask = static_cast<uint>(_mm256_movemask_epi8(found));
+
+		if (mask != 0)
+		{
+			return begin + __builtin_ctz(mask);
+		}
+
+		begin += 32;
+	}
+
+	return Sse2NextQuoteOrEscape(begin, end);
+}
+
+static bool HasAvx2()
+{
+	// This runs from a static initialiser, possibly before the compiler's
+	// own CPU detection has been set up.
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+static const ScanKernels s_Avx2Kernels = {
+	Avx2NextSpecial, Avx2NextQuoteOrEscape,
+	Avx2NextSpecial, Avx2NextQuoteOrEscape,
+	"avx2"
+};
+
+static const ScanKernels s_Sse2Kernels = {
+	Sse2NextSpecial, Sse2NextQuoteOrEscape,
+	Sse2NextSpecial, Sse2NextQuoteOrEscape,
+	"sse2"
+};
+
+static const ScanKernels& s_Kernels = HasAvx2() ? s_Avx2Kernels : s_Sse2Kernels;
+
+#else
+
+static const ScanKernels s_Kernels = {
+	ScalarNextSpecial, ScalarNextQuoteOrEscape,
+	ScalarNextSpecial, ScalarNextQuoteOrEscape,
+	"scalar"
+};
+
+#endif // DELIMITERSCANNER_X86
+
+const ushort* DelimiterScanner::NextSpecial(const ushort* begin,
+	const ushort* end)
+{
+	return s_Kernels.nextSpecial(begin, end);
+}
+
+const ushort* DelimiterScanner::NextQuoteOrEscape(const ushort* begin,
+	const ushort* end)
+{
+	return s_Kernels.nextQuoteOrEscape(begin, end);
+}
+
+const char* DelimiterScanner::NextSpecial(const char* begin, const char* end)
+{
+	return s_Kernels.nextSpecialByte(begin, end);
+}
+
+const char* DelimiterScanner::NextQuoteOrEscape(const char* begin,
+	const char* end)
+{
+	return s_Kernels.nextQuoteOrEscapeByte(begin, end);
+}
+
+const char* DelimiterScanner::Implementation()
+{
+	return s_Kernels.name;
+}
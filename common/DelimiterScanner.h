@@ -0,0 +1,41 @@
+//
+// DelimiterScanner.h
+//
+// Find the next character that could end or change the meaning of a term,
+// checking many characters at a time where the CPU allows it.
+//
+// (c) 2014 Graham West
+
+#if !defined(DELIMITERSCANNER_H)
+#define DELIMITERSCANNER_H
+
+// Library headers.
+#include <QtGlobal>
+
+class DelimiterScanner
+{
+public:
+	// Returns the first character in [begin, end) that is one of
+	// # { } = " \ . or is whitespace, or end if there isn't one. Control
+	// characters and anything outside ASCII are returned as well, so the
+	// caller has to classify whatever it is given back.
+	static const ushort* NextSpecial(const ushort* begin, const ushort* end);
+
+	// Inside quotes only the close quote or an escape matters.
+	static const ushort* NextQuoteOrEscape(const ushort* begin, const ushort* end);
+
+	// The same for UTF-8. Every byte of a multi-byte sequence is returned,
+	// as none of them are ASCII.
+	static const char* NextSpecial(const char* begin, const char* end);
+	static const char* NextQuoteOrEscape(const char* begin, const char* end);
+
+	// Name of the kernel picked for this CPU, for logging.
+	static const char* Implementation();
+
+private:
+	DelimiterScanner();
+	DelimiterScanner(const DelimiterScanner& src);
+	DelimiterScanner& operator=(const DelimiterScanner& src);
+};
+
+#endif // DELIMITERSCANNER_H
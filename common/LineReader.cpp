@@ -0,0 +1,149 @@
+//
+// LineReader.cpp
+//
+// Split a device into lines of any length, reading it a chunk at a time
+// into a buffer which only grows as far as the longest line needs.
+//
+// (c) 2014 Graham West
+
+// Class header, always comes first.
+#include "LineReader.h"
+
+// System headers.
+#include <string.h>
+
+LineReader::LineReader(QIODevice* device, int chunkSize, int maxLineLength) :
+	m_Device(device), m_ChunkSize(chunkSize), m_MaxLineLength(maxLineLength),
+	m_Start(0), m_Scanned(0), m_End(0), m_AtEnd(false), m_Terminated(false),
+	m_Position(device ? device->pos() : 0),
+	m_Error(ERROR_OK)
+{
+	if (m_ChunkSize <= 0)
+	{
+		m_ChunkSize = DEFAULT_CHUNK_SIZE;
+	}
+
+	m_Buffer.resize(2 * m_ChunkSize);
+}
+
+LineReader::~LineReader()
+{
+}
+
+bool LineReader::NextLine(const char*& line, int& length)
+{
+	bool retval = false;
+	bool done = (m_Error != ERROR_OK);
+
+	line = 0;
+	length = 0;
+
+	while (!done)
+	{
+		const char* data = m_Buffer.constData();
+		const char* newline = static_cast<const char*>(memchr(data + m_Scanned,
+			'\n', m_End - m_Scanned));
+
+		if (newline)
+		{
+			line = data + m_Start;
+			length = static_cast<int>(newline - line);
+			m_Position += length + 1;
+			m_Start = m_Scanned = static_cast<int>(newline - data) + 1;
+			m_Terminated = true;
+			retval = true;
+			done = true;
+		}
+		else
+		{
+			// Whatever we have so far is part of a line which continues in
+			// the next chunk, so we don't need to look at it again.
+			m_Scanned = m_End;
+
+			if (m_AtEnd || !Fill())
+			{
+				// The last line doesn't have to be terminated.
+				if (m_Error == ERROR_OK && m_Start < m_End)
+				{
+					// Fill may have moved the buffer.
+					line = m_Buffer.constData() + m_Start;
+					length = m_End - m_Start;
+					m_Position += length;
+					m_Start = m_Scanned = m_End;
+					m_Terminated = false;
+					retval = true;
+				}
+
+				done = true;
+			}
+		}
+	}
+
+	return retval;
+}
+
+bool LineReader::Fill()
+{
+	bool retval = false;
+	int pending = m_End - m_Start;
+
+	// Keep the partial line, and move it to the front to make room.
+	if (m_Start > 0)
+	{
+		if (pending > 0)
+		{
+			memmove(m_Buffer.data(), m_Buffer.constData() + m_Start, pending);
+		}
+
+		m_Scanned -= m_Start;
+		m_End = pending;
+		m_Start = 0;
+	}
+
+	if (m_MaxLineLength > 0 && pending > m_MaxLineLength)
+	{
+		// Rather than split the line somewhere arbitrary, stop.
+		m_Error = ERROR_LINE_TOO_LONG;
+		return false;
+	}
+
+	// There's always room for a chunk after a line shorter than a chunk, so
+	// the buffer only grows for a line longer than that.
+	if (m_Buffer.size() - m_End < m_ChunkSize)
+	{
+		qint64 wanted = static_cast<qint64>(m_Buffer.size()) * 2;
+
+		if (m_MaxLineLength > 0)
+		{
+			wanted = qMin(wanted, static_cast<qint64>(m_MaxLineLength) + 2 * m_ChunkSize);
+		}
+
+		if (wanted > 0x7fffffff)
+		{
+			m_Error = ERROR_LINE_TOO_LONG;
+			return false;
+		}
+
+		m_Buffer.resize(static_cast<int>(wanted));
+	}
+
+	qint64 bytesRead = m_Device->read(m_Buffer.data() + m_End,
+		m_Buffer.size() - m_End);
+
+	if (bytesRead > 0)
+	{
+		m_End += static_cast<int>(bytesRead);
+		retval = true;
+	}
+	else
+	{
+		if (bytesRead < 0)
+		{
+			m_Error = ERROR_READ_FAILED;
+		}
+
+		m_AtEnd = true;
+	}
+
+	return retval;
+}
@@ -0,0 +1,68 @@
+//
+// LineReader.h
+//
+// Split a device into lines of any length, reading it a chunk at a time
+// into a buffer which only grows as far as the longest line needs.
+//
+// (c) 2014 Graham West
+
+#if !defined(LINEREADER_H)
+#define LINEREADER_H
+
+// Library headers.
+#include <QByteArray>
+#include <QIODevice>
+
+class LineReader
+{
+public:
+	enum Error {
+		ERROR_OK = 0,
+		ERROR_LINE_TOO_LONG,
+		ERROR_READ_FAILED
+	};
+
+	static const int DEFAULT_CHUNK_SIZE = 64 * 1024;
+	static const int DEFAULT_MAX_LINE_LENGTH = 256 * 1024 * 1024;
+
+	// A maxLineLength of 0 lets the buffer grow as far as any line needs.
+	// Reading starts wherever the device is, which may be part way in.
+	explicit LineReader(QIODevice* device, int chunkSize = DEFAULT_CHUNK_SIZE,
+		int maxLineLength = DEFAULT_MAX_LINE_LENGTH);
+	~LineReader();
+
+	// Returns false at the end of the device or on error. The line doesn't
+	// include its newline, and stays valid until the next call.
+	bool NextLine(const char*& line, int& length);
+
+	inline Error LastError() const { return m_Error; }
+
+	// Whether the last line returned ended with a newline. Only the last
+	// line of the device can be without one.
+	inline bool Terminated() const { return m_Terminated; }
+
+	// Offset in the device of the start of the next line.
+	inline qint64 Position() const { return m_Position; }
+
+private:
+	LineReader();
+	LineReader(const LineReader& src);
+	LineReader& operator=(const LineReader& src);
+
+	bool Fill();
+
+	QIODevice* m_Device;
+	int m_ChunkSize;
+	int m_MaxLineLength;
+
+	QByteArray m_Buffer;
+	int m_Start;
+	int m_Scanned;
+	int m_End;
+	bool m_AtEnd;
+	bool m_Terminated;
+	qint64 m_Position;
+	Error m_Error;
+};
+
+#endif // LINEREADER_H
@@ -9,91 +9,705 @@
 // Class header, always comes first.
 #include "StringDeduplicator.h"
 
+// System headers.
+#include <limits.h>
+#include <string.h>
+
 // Library headers.
-#include <QHash>
+#include <QMutexLocker>
+#include <QtEndian>
 
-// Used when we're asked to retrieve something that hasn't been stored.
-static const QString emptyStr("");
+const char StringDeduplicator::TABLE_MAGIC[8] =
+	{ 'C', 'C', 'S', 'T', 'R', 'T', 'A', 'B' };
 
-StringDeduplicator* StringDeduplicator::m_Instance = 0;
+QAtomicPointer<StringDeduplicator> StringDeduplicator::m_Instance;
+QAtomicInt StringDeduplicator::m_Generation;
 
-StringDeduplicator::StringDeduplicator()
+StringDeduplicator::StringDeduplicator() : m_NextId(1), m_TableMapped(0)
 {
+	for (int space = 0; space < KEY_SPACES; space++)
+	{
+		for (int shard = 0; shard < SHARDS; shard++)
+		{
+			Shard& current = m_Shards[space][shard];
+			current.count = 0;
+			current.next = 0;
+			current.end = 0;
+			current.chunkSize = INITIAL_CHUNK_SIZE;
+			current.bytes = 0;
+		}
+	}
 }
 
 StringDeduplicator::~StringDeduplicator()
 {
+	for (int space = 0; space < KEY_SPACES; space++)
+	{
+		for (int shard = 0; shard < SHARDS; shard++)
+		{
+			Shard& current = m_Shards[space][shard];
+			current.retired.push_back(current.table.load());
+
+			for (int count = 0; count < current.retired.size(); count++)
+			{
+				if (current.retired[count])
+				{
+					delete [] current.retired[count]->ids;
+					delete current.retired[count];
+				}
+			}
+
+			for (int count = 0; count < current.chunks.size(); count++)
+			{
+				delete [] current.chunks[count];
+			}
+		}
+	}
+
+	for (uint block = 0; block < MAX_BLOCKS; block++)
+	{
+		delete [] m_Blocks[block].load();
+	}
+
+	if (m_TableMapped)
+	{
+		m_TableFile.unmap(m_TableMapped);
+	}
 }
 
 StringDeduplicator* StringDeduplicator::Instance()
 {
-	if (!m_Instance)
+	StringDeduplicator* retval = m_Instance.loadAcquire();
+
+	if (!retval)
 	{
-		m_Instance = new StringDeduplicator;
+		// If another thread gets there first, use its instance instead.
+		StringDeduplicator* created = new StringDeduplicator;
+
+		if (m_Instance.testAndSetOrdered(0, created))
+		{
+			retval = created;
+		}
+		else
+		{
+			delete created;
+			retval = m_Instance.loadAcquire();
+		}
 	}
 	
-	return m_Instance;
+	return retval;
 }
 
 uint StringDeduplicator::Find(const QString& str)
 {
-	uint retval = 0;
 	StringDeduplicator* dedup = StringDeduplicator::Instance();
-	uint strHash = qHash(str);
+	QByteArray utf8 = str.toUtf8();
 
-	if (dedup->m_Strings.contains(strHash))
-	{
-		retval = strHash;
-	}
+	return dedup->Lookup(EXACT, utf8.constData(), utf8.size(),
+		Hash(utf8.constData(), utf8.size()));
+}
 
-	return retval;
+uint StringDeduplicator::FindNoCase(const QString& str)
+{
+	StringDeduplicator* dedup = StringDeduplicator::Instance();
+	QByteArray lower = str.toLower().toUtf8();
+
+	return dedup->Lookup(NO_CASE, lower.constData(), lower.size(),
+		Hash(lower.constData(), lower.size()));
 }
 
 uint StringDeduplicator::Store(const QString& str)
 {
-	uint hash = qHash(str);
+	QByteArray utf8 = str.toUtf8();
+
+	return Store(utf8.constData(), utf8.size());
+}
+
+uint StringDeduplicator::Store(const char* utf8, int length)
+{
+	StringDeduplicator* dedup = StringDeduplicator::Instance();
 
-	return Add(hash, str);
+	return dedup->Add(EXACT, utf8, length, utf8, length);
 }
 
 uint StringDeduplicator::StoreNoCase(const QString& str)
 {
-	QString lower = str.toLower();
-	uint hash = qHash(lower);
+	QByteArray utf8 = str.toUtf8();
 
-	return Add(hash, str);
+	return StoreNoCase(utf8.constData(), utf8.size());
 }
 
-uint StringDeduplicator::Add(uint hash, const QString& str)
+uint StringDeduplicator::StoreNoCase(const char* utf8, int length)
 {
 	StringDeduplicator* dedup = StringDeduplicator::Instance();
-	DeduplicatorMap::const_iterator iter = dedup->m_Strings.end();
-	
-	iter = dedup->m_Strings.insert(hash, str);
-	
-	return iter.key();
+	QByteArray lower;
+
+	// Attribute names are nearly always lower case already, so don't make
+	// a copy unless it's needed.
+	if (LowerCase(utf8, length, lower))
+	{
+		return dedup->Add(NO_CASE, lower.constData(), lower.size(), utf8, length);
+	}
+	else
+	{
+		return dedup->Add(NO_CASE, utf8, length, utf8, length);
+	}
 }
 
-const QString& StringDeduplicator::Retrieve(uint hash)
+InternedString StringDeduplicator::Retrieve(uint id)
 {
 	StringDeduplicator* dedup = StringDeduplicator::Instance();
-	DeduplicatorMap::const_iterator iter = dedup->m_Strings.find(hash);
+	const Entry* entry = dedup->EntryFor(id);
 	
-	if (iter == dedup->m_Strings.end())
+	// Strings are never removed or moved, so the bytes stay where they are.
+	if (entry && entry->data)
 	{
-		return emptyStr;
+		return InternedString(entry->data, entry->length, entry->ascii);
 	}
 	else
 	{
-		return iter.value();
+		return InternedString();
 	}
 }
 
 int StringDeduplicator::Total()
 {
-	int retval = 0;
 	StringDeduplicator* dedup = StringDeduplicator::Instance();
+
+	return dedup->m_NextId.loadAcquire() - 1;
+}
+
+qint64 StringDeduplicator::BytesUsed()
+{
+	StringDeduplicator* dedup = StringDeduplicator::Instance();
+	qint64 retval = sizeof(StringDeduplicator);
+
+	for (int space = 0; space < KEY_SPACES; space++)
+	{
+		for (int shard = 0; shard < SHARDS; shard++)
+		{
+			Shard& current = dedup->m_Shards[space][shard];
+			QMutexLocker locker(&current.lock);
+
+			retval += current.bytes;
+		}
+	}
+
+	for (uint block = 0; block < MAX_BLOCKS; block++)
+	{
+		if (dedup->m_Blocks[block].loadAcquire())
+		{
+			retval += BLOCK_SIZE * sizeof(Entry);
+		}
+	}
+
+	retval += dedup->m_TableMapped ? dedup->m_TableFile.size() :
+		dedup->m_TableCopy.size();
+
+	return retval;
+}
+
+void StringDeduplicator::Compact(const QBitArray& live, QVector<uint>& newIdsDest)
+{
+	StringDeduplicator* dedup = StringDeduplicator::Instance();
+	StringDeduplicator* compacted = new StringDeduplicator;
+	uint total = static_cast<uint>(Total());
+
+	newIdsDest.fill(0, total + 1);
+
+	// Storing the survivors in their old order numbers them densely again,
+	// and copies their bytes into chunks of their own.
+	for (uint id = 1; id <= total; id++)
+	{
+		const Entry* entry = dedup->EntryFor(id);
+
+		if (entry && entry->data && id < static_cast<uint>(live.size()) &&
+			live.testBit(id))
+		{
+			newIdsDest[id] = compacted->Add(static_cast<KeySpace>(entry->space),
+				entry->key, entry->keyLength, entry->data, entry->length);
+		}
+	}
+
+	m_Instance.storeRelease(compacted);
+	m_Generation.fetchAndAddOrdered(1);
+	delete dedup;
+}
+
+int StringDeduplicator::Generation()
+{
+	return m_Generation.loadAcquire();
+}
+
+bool StringDeduplicator::Save(const QString& fileName)
+{
+	bool retval = false;
+	StringDeduplicator* dedup = StringDeduplicator::Instance();
+	uint total = static_cast<uint>(Total());
+	QByteArray records;
+
+	for (uint id = 1; id <= total; id++)
+	{
+		const Entry* entry = dedup->EntryFor(id);
+		uchar fields[TABLE_RECORD_SIZE];
+		bool ownKey = (entry->key != entry->data);
+
+		qToLittleEndian<quint32>(entry->hash, fields);
+		qToLittleEndian<quint32>(entry->length, fields + sizeof(quint32));
+		qToLittleEndian<quint32>(entry->keyLength, fields + 2 * sizeof(quint32));
+		fields[3 * sizeof(quint32)] = entry->space;
+		fields[3 * sizeof(quint32) + 1] = entry->ascii ? 1 : 0;
+		fields[3 * sizeof(quint32) + 2] = ownKey ? 1 : 0;
+		fields[3 * sizeof(quint32) + 3] = 0;
+
+		records.append(reinterpret_cast<const char*>(fields), sizeof(fields));
+		records.append(entry->data, entry->length);
+
+		if (ownKey)
+		{
+			records.append(entry->key, entry->keyLength);
+		}
+	}
+
+	uchar header[TABLE_HEADER_SIZE];
+	memcpy(header, TABLE_MAGIC, sizeof(TABLE_MAGIC));
+	qToLittleEndian<quint32>(TABLE_VERSION, header + sizeof(TABLE_MAGIC));
+	qToLittleEndian<quint32>(total, header + sizeof(TABLE_MAGIC) + sizeof(quint32));
+	qToLittleEndian<quint32>(records.size(),
+		header + sizeof(TABLE_MAGIC) + 2 * sizeof(quint32));
+	qToLittleEndian<quint32>(Hash(records.constData(), records.size()),
+		header + sizeof(TABLE_MAGIC) + 3 * sizeof(quint32));
+
+	QFile file(fileName);
+
+	if (file.open(QIODevice::WriteOnly))
+	{
+		retval = (file.write(reinterpret_cast<const char*>(header),
+			sizeof(header)) == sizeof(header) &&
+			file.write(records) == records.size());
+
+		file.close();
+	}
+
+	return retval;
+}
+
+bool StringDeduplicator::Load(const QString& fileName)
+{
+	bool retval = false;
+	StringDeduplicator* dedup = StringDeduplicator::Instance();
+
+	if (Total() == 0 && !dedup->m_TableMapped && dedup->m_TableCopy.isEmpty())
+	{
+		dedup->m_TableFile.setFileName(fileName);
+
+		if (dedup->m_TableFile.open(QIODevice::ReadOnly))
+		{
+			qint64 fileSize = dedup->m_TableFile.size();
+
+			if (fileSize > 0)
+			{
+				dedup->m_TableMapped = dedup->m_TableFile.map(0, fileSize);
+			}
+
+			if (dedup->m_TableMapped)
+			{
+				retval = dedup->LoadTable(dedup->m_TableMapped, fileSize);
+
+				if (!retval)
+				{
+					dedup->m_TableFile.unmap(dedup->m_TableMapped);
+					dedup->m_TableMapped = 0;
+				}
+			}
+			else
+			{
+				dedup->m_TableCopy = dedup->m_TableFile.readAll();
+				retval = dedup->LoadTable(
+					reinterpret_cast<const uchar*>(dedup->m_TableCopy.constData()),
+					dedup->m_TableCopy.size());
+
+				if (!retval)
+				{
+					dedup->m_TableCopy.clear();
+				}
+			}
+
+			// The mapping outlives the file being open.
+			dedup->m_TableFile.close();
+		}
+	}
+
+	return retval;
+}
+
+bool StringDeduplicator::LoadTable(const uchar* data, qint64 size)
+{
+	bool retval = false;
+
+	if (size >= TABLE_HEADER_SIZE &&
+		memcmp(data, TABLE_MAGIC, sizeof(TABLE_MAGIC)) == 0 &&
+		qFromLittleEndian<quint32>(data + sizeof(TABLE_MAGIC)) == TABLE_VERSION)
+	{
+		const uchar* pos = data + sizeof(TABLE_MAGIC) + sizeof(quint32);
+		quint32 total = qFromLittleEndian<quint32>(pos);
+		quint32 recordsSize = qFromLittleEndian<quint32>(pos + sizeof(quint32));
+		quint32 hash = qFromLittleEndian<quint32>(pos + 2 * sizeof(quint32));
+		const uchar* records = data + TABLE_HEADER_SIZE;
+		const uchar* end = records + recordsSize;
+
+		retval = (recordsSize == size - TABLE_HEADER_SIZE &&
+			total / BLOCK_SIZE < MAX_BLOCKS &&
+			Hash(reinterpret_cast<const char*>(records), recordsSize) == hash);
+
+		// Make sure every record fits before using any of them, so a bad
+		// file leaves nothing half loaded.
+		pos = records;
+
+		for (quint32 count = 0; retval && count < total; count++)
+		{
+			if (end - pos < TABLE_RECORD_SIZE)
+			{
+				retval = false;
+			}
+			else
+			{
+				qint64 length = qFromLittleEndian<quint32>(pos + sizeof(quint32));
+				qint64 keyLength = qFromLittleEndian<quint32>(pos + 2 * sizeof(quint32));
+				uchar space = pos[3 * sizeof(quint32)];
+				bool ownKey = (pos[3 * sizeof(quint32) + 2] != 0);
+				qint64 recordSize = TABLE_RECORD_SIZE + length + (ownKey ? keyLength : 0);
+
+				retval = (space < KEY_SPACES && recordSize <= end - pos &&
+					length <= INT_MAX && keyLength <= INT_MAX &&
+					(ownKey || keyLength == length));
+
+				if (retval)
+				{
+					pos += recordSize;
+				}
+			}
+		}
+
+		retval = (retval && pos == end);
+
+		pos = records;
+
+		for (quint32 id = 1; retval && id <= total; id++)
+		{
+			Entry& entry = Block(id / BLOCK_SIZE)[id % BLOCK_SIZE];
+			bool ownKey = (pos[3 * sizeof(quint32) + 2] != 0);
+
+			entry.hash = qFromLittleEndian<quint32>(pos);
+			entry.length = qFromLittleEndian<quint32>(pos + sizeof(quint32));
+			entry.keyLength = qFromLittleEndian<quint32>(pos + 2 * sizeof(quint32));
+			entry.space = pos[3 * sizeof(quint32)];
+			entry.ascii = (pos[3 * sizeof(quint32) + 1] != 0);
+			entry.data = reinterpret_cast<const char*>(pos + TABLE_RECORD_SIZE);
+			entry.key = ownKey ? entry.data + entry.length : entry.data;
+			pos += TABLE_RECORD_SIZE + entry.length + (ownKey ? entry.keyLength : 0);
+
+			Shard& shard = m_Shards[entry.space][entry.hash & (SHARDS - 1)];
+			Table* table = shard.table.load();
+
+			if (!table || static_cast<uint>(shard.count + 1) * 2 > table->mask + 1)
+			{
+				Grow(shard);
+				table = shard.table.load();
+			}
+
+			Insert(table, entry.hash, id);
+			shard.count++;
+		}
+
+		if (retval)
+		{
+			m_NextId.storeRelease(total + 1);
+		}
+	}
+
+	return retval;
+}
+
+uint StringDeduplicator::Lookup(KeySpace space, const char* key, int keyLength,
+	uint hash) const
+{
+	uint retval = 0;
+	const Shard& shard = m_Shards[space][hash & (SHARDS - 1)];
+	const Table* table = shard.table.loadAcquire();
+
+	if (table)
+	{
+		// The low bits picked the shard, so probe with the others.
+		uint slot = (hash >> SHARD_BITS) & table->mask;
+		uint id = static_cast<uint>(table->ids[slot].loadAcquire());
+
+		while (retval == 0 && id != 0)
+		{
+			const Entry* entry = EntryFor(id);
+
+			if (entry && entry->hash == hash && entry->keyLength == keyLength &&
+				memcmp(entry->key, key, keyLength) == 0)
+			{
+				retval = id;
+			}
+			else
+			{
+				slot = (slot + 1) & table->mask;
+				id = static_cast<uint>(table->ids[slot].loadAcquire());
+			}
+		}
+	}
+
+	return retval;
+}
+
+uint StringDeduplicator::Add(KeySpace space, const char* key, int keyLength,
+	const char* display, int displayLength)
+{
+	uint hash = Hash(key, keyLength);
+	uint retval = Lookup(space, key, keyLength, hash);
+	
+	if (retval == 0)
+	{
+		Shard& shard = m_Shards[space][hash & (SHARDS - 1)];
+		QMutexLocker locker(&shard.lock);
+
+		// Another thread may have stored it since we looked.
+		retval = Lookup(space, key, keyLength, hash);
+
+		if (retval == 0)
+		{
+			uint id = static_cast<uint>(m_NextId.fetchAndAddOrdered(1));
+
+			// Past the last block there's nowhere to put it, which would
+			// take hundreds of millions of strings.
+			if (id / BLOCK_SIZE < MAX_BLOCKS)
+			{
+				bool sameKey = (key == display && keyLength == displayLength);
+				char* data = Allocate(shard, displayLength + (sameKey ? 0 : keyLength));
+
+				memcpy(data, display, displayLength);
+
+				Entry& entry = Block(id / BLOCK_SIZE)[id % BLOCK_SIZE];
+				entry.data = data;
+				entry.length = displayLength;
+				entry.hash = hash;
+				entry.ascii = IsAscii(display, displayLength);
+				entry.space = static_cast<uchar>(space);
+
+				if (sameKey)
+				{
+					entry.key = data;
+				}
+				else
+				{
+					entry.key = data + displayLength;
+					memcpy(data + displayLength, key, keyLength);
+				}
+
+				entry.keyLength = keyLength;
+
+				Table* table = shard.table.load();
+
+				if (!table || static_cast<uint>(shard.count + 1) * 2 > table->mask + 1)
+				{
+					Grow(shard);
+					table = shard.table.load();
+				}
+
+				// Publishing the ID in the table also publishes the entry.
+				Insert(table, hash, id);
+				shard.count++;
+				retval = id;
+			}
+		}
+	}
 	
-	retval = dedup->m_Strings.size();
+	return retval;
+}
+
+const StringDeduplicator::Entry* StringDeduplicator::EntryFor(uint id) const
+{
+	const Entry* retval = 0;
+
+	if (id != 0 && id / BLOCK_SIZE < MAX_BLOCKS)
+	{
+		const Entry* block = m_Blocks[id / BLOCK_SIZE].loadAcquire();
+
+		if (block)
+		{
+			retval = block + (id % BLOCK_SIZE);
+		}
+	}
+
+	return retval;
+}
+
+StringDeduplicator::Entry* StringDeduplicator::Block(uint block)
+{
+	Entry* retval = m_Blocks[block].loadAcquire();
+
+	if (!retval)
+	{
+		// IDs are handed out across shards, so two threads can need the same
+		// new block at once.
+		Entry* created = new Entry[BLOCK_SIZE];
+		memset(created, 0, BLOCK_SIZE * sizeof(Entry));
+
+		if (m_Blocks[block].testAndSetOrdered(0, created))
+		{
+			retval = created;
+		}
+		else
+		{
+			delete [] created;
+			retval = m_Blocks[block].loadAcquire();
+		}
+	}
+
+	return retval;
+}
+
+void StringDeduplicator::Grow(Shard& shard)
+{
+	Table* oldTable = shard.table.load();
+	uint slotCount = oldTable ? (oldTable->mask + 1) * 2 : INITIAL_SLOTS;
+
+	Table* newTable = new Table;
+	newTable->mask = slotCount - 1;
+	newTable->ids = new QAtomicInt[slotCount];
+	shard.bytes += sizeof(Table) + slotCount * sizeof(QAtomicInt);
+
+	if (oldTable)
+	{
+		for (uint slot = 0; slot <= oldTable->mask; slot++)
+		{
+			uint id = static_cast<uint>(oldTable->ids[slot].load());
+
+			if (id != 0)
+			{
+				Insert(newTable, EntryFor(id)->hash, id);
+			}
+		}
+
+		shard.retired.push_back(oldTable);
+	}
+
+	shard.table.storeRelease(newTable);
+}
+
+char* StringDeduplicator::Allocate(Shard& shard, int bytes)
+{
+	if (!shard.next || shard.end - shard.next < bytes)
+	{
+		// A string too big for a chunk gets one to itself.
+		int size = qMax(shard.chunkSize, bytes);
+		char* chunk = new char[size];
+
+		shard.chunks.push_back(chunk);
+		shard.bytes += size;
+
+		if (size == shard.chunkSize)
+		{
+			shard.next = chunk;
+			shard.end = chunk + size;
+			shard.chunkSize = qMin(shard.chunkSize * 2, static_cast<int>(MAX_CHUNK_SIZE));
+		}
+		else
+		{
+			return chunk;
+		}
+	}
+
+	char* retval = shard.next;
+	shard.next += bytes;
+
+	return retval;
+}
+
+void StringDeduplicator::Insert(Table* table, uint hash, uint id)
+{
+	uint slot = (hash >> SHARD_BITS) & table->mask;
+
+	while (table->ids[slot].load() != 0)
+	{
+		slot = (slot + 1) & table->mask;
+	}
+
+	table->ids[slot].storeRelease(static_cast<int>(id));
+}
+
+uint StringDeduplicator::Hash(const char* data, int length)
+{
+	// FNV-1a, over the UTF-8 bytes.
+	uint retval = 2166136261u;
+
+	for (int count = 0; count < length; count++)
+	{
+		retval ^= static_cast<uchar>(data[count]);
+		retval *= 16777619u;
+	}
+
+	return retval;
+}
+
+bool StringDeduplicator::IsAscii(const char* data, int length)
+{
+	bool retval = true;
+
+	for (int count = 0; retval && count < length; count++)
+	{
+		if (static_cast<uchar>(data[count]) >= 0x80)
+		{
+			retval = false;
+		}
+	}
+
+	return retval;
+}
+
+bool StringDeduplicator::LowerCase(const char* utf8, int length, QByteArray& lowerDest)
+{
+	bool retval = false;
+	bool ascii = true;
+
+	for (int count = 0; count < length; count++)
+	{
+		uchar ch = static_cast<uchar>(utf8[count]);
+
+		if (ch >= 0x80)
+		{
+			ascii = false;
+		}
+		else if (ch >= 'A' && ch <= 'Z')
+		{
+			retval = true;
+		}
+	}
+
+	if (!ascii)
+	{
+		// Leave anything beyond ASCII to Qt's rules.
+		QString lower = QString::fromUtf8(utf8, length).toLower();
+		lowerDest = lower.toUtf8();
+		retval = (lowerDest.size() != length ||
+			memcmp(lowerDest.constData(), utf8, length) != 0);
+	}
+	else if (retval)
+	{
+		lowerDest = QByteArray(utf8, length);
+
+		for (int count = 0; count < length; count++)
+		{
+			char ch = lowerDest[count];
+
+			if (ch >= 'A' && ch <= 'Z')
+			{
+				lowerDest[count] = static_cast<char>(ch - 'A' + 'a');
+			}
+		}
+	}
+
 	return retval;
 }
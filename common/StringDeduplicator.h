@@ -6,10 +6,53 @@
 //
 // (c) 2014 Graham West
 
+#if !defined(STRINGDEDUPLICATOR_H)
+#define STRINGDEDUPLICATOR_H
+
 // Library headers.
-#include <QMap>
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QBitArray>
+#include <QByteArray>
+#include <QFile>
+#include <QMutex>
 #include <QString>
+#include <QVector>
+
+// A stored string's UTF-8 bytes, which never move or change. It's only a
+// pointer and a length, so it's cheap to pass around by value.
+class InternedString
+{
+public:
+	InternedString() : m_Data(""), m_Length(0), m_Ascii(true) {}
+	InternedString(const char* data, int length, bool ascii) :
+		m_Data(data), m_Length(length), m_Ascii(ascii) {}
+
+	inline const char* Data() const { return m_Data; }
+	inline int Length() const { return m_Length; }
+	inline bool IsEmpty() const { return (m_Length == 0); }
+
+	// Plain ASCII, which is most strings, converts more quickly.
+	inline QString ToString() const
+	{
+		return m_Ascii ? QString::fromLatin1(m_Data, m_Length) :
+			QString::fromUtf8(m_Data, m_Length);
+	}
+
+private:
+	const char* m_Data;
+	int m_Length;
+	bool m_Ascii;
+};
 
+// Every distinct string gets the next ID in turn, starting from 1, so IDs
+// are small enough to index arrays by. ID 0 is never handed out: Find and
+// FindNoCase return it for strings that haven't been stored, and it
+// retrieves as an empty string.
+//
+// Any number of threads can use it at once. Finding or retrieving a string
+// that's already stored never takes a lock; storing a new one only locks
+// the one shard of the table its hash falls in.
 class StringDeduplicator
 {
 public:
@@ -19,22 +62,137 @@ public:
 	static StringDeduplicator* Instance();
 
 	static uint Find(const QString& str);
+	static uint FindNoCase(const QString& str);
 	static uint Store(const QString& str);
+	static uint Store(const char* utf8, int length);
+
+	// Strings differing only in case share an ID, which retrieves as the
+	// first of them to be stored. These IDs are separate from Store's.
 	static uint StoreNoCase(const QString& str);
-	static const QString& Retrieve(uint hash);
+	static uint StoreNoCase(const char* utf8, int length);
+
+	static InternedString Retrieve(uint id);
 	
 	static int Total();
+
+	// Everything allocated to hold the strings and find them again.
+	static qint64 BytesUsed();
+
+	// Forget every string whose ID isn't set in live, and renumber the rest
+	// from 1 in the same order. newIdsDest maps each old ID to its new one,
+	// or to 0 for a string that has gone. No other thread may be using the
+	// deduplicator meanwhile, and anything retrieved before is invalid
+	// afterwards.
+	static void Compact(const QBitArray& live, QVector<uint>& newIdsDest);
+
+	// Goes up by one with every Compact, so anything holding on to IDs can
+	// tell they have changed.
+	static int Generation();
+
+	// Write every string to a table file, which Load can map straight back
+	// in before anything else is stored, keeping the same IDs without
+	// copying or hashing the strings again. Load fails, leaving nothing
+	// stored, if strings are already stored or the file doesn't check out.
+	// Neither may run while other threads are using the deduplicator.
+	static bool Save(const QString& fileName);
+	static bool Load(const QString& fileName);
 	
 private:
 	StringDeduplicator(const StringDeduplicator& src);
 	StringDeduplicator& operator=(const StringDeduplicator& src);
 
-	static StringDeduplicator* m_Instance;
-	
-	static uint Add(uint hash, const QString& str);
+	static const int SHARD_BITS = 6;
+	static const int SHARDS = 1 << SHARD_BITS;
+	static const int INITIAL_SLOTS = 64;
 
-	typedef QMap<uint, QString> DeduplicatorMap;
-	
-	DeduplicatorMap m_Strings;
-	
+	// The bytes of each shard's strings are packed into chunks which start
+	// small and double up to the maximum.
+	static const int INITIAL_CHUNK_SIZE = 4 * 1024;
+	static const int MAX_CHUNK_SIZE = 1024 * 1024;
+
+	// Entries are kept in blocks which never move once made, so the IDs
+	// can be looked up without a lock while more strings are added.
+	static const uint BLOCK_SIZE = 4096;
+	static const uint MAX_BLOCKS = 65536;
+
+	// A table file is a header of magic, version, string count, size of
+	// the records and a hash of them, followed by the records in ID order.
+	// Each record is the string's hash, length and key length as
+	// little-endian quint32s, then its key space, whether it's ASCII and
+	// whether it has a key of its own as bytes, and a padding byte. Its
+	// bytes follow, and then its key's if it has one.
+	static const char TABLE_MAGIC[8];
+	static const quint32 TABLE_VERSION = 1;
+	static const int TABLE_HEADER_SIZE = sizeof(TABLE_MAGIC) + 4 * sizeof(quint32);
+	static const int TABLE_RECORD_SIZE = 4 * sizeof(quint32);
+
+	enum KeySpace {
+		EXACT = 0,
+		NO_CASE,
+		KEY_SPACES
+	};
+
+	// The key is the string itself unless it's mixed case and stored
+	// without regard to case, in which case the lower case key follows it.
+	typedef struct Entry {
+		const char* data;
+		const char* key;
+		int length;
+		int keyLength;
+		uint hash;
+		bool ascii;
+		uchar space;
+	} Entry;
+
+	// Open addressing with linear probing, holding IDs, and never more than
+	// half full. Slots only ever go from 0 to an ID, so readers need no
+	// lock; a table that has been grown out of is kept until we are
+	// destroyed, in case a reader is still looking at it.
+	typedef struct Table {
+		uint mask;
+		QAtomicInt* ids;
+	} Table;
+
+	// Everything but the table is only touched with the lock held.
+	typedef struct Shard {
+		QMutex lock;
+		QAtomicPointer<Table> table;
+		int count;
+		QVector<Table*> retired;
+		QVector<char*> chunks;
+		char* next;
+		char* end;
+		int chunkSize;
+		qint64 bytes;
+	} Shard;
+
+	uint Lookup(KeySpace space, const char* key, int keyLength, uint hash) const;
+	uint Add(KeySpace space, const char* key, int keyLength, const char* display,
+		int displayLength);
+	const Entry* EntryFor(uint id) const;
+	Entry* Block(uint block);
+	void Grow(Shard& shard);
+	char* Allocate(Shard& shard, int bytes);
+
+	bool LoadTable(const uchar* data, qint64 size);
+
+	static void Insert(Table* table, uint hash, uint id);
+	static uint Hash(const char* data, int length);
+	static bool IsAscii(const char* data, int length);
+	static bool LowerCase(const char* utf8, int length, QByteArray& lowerDest);
+
+	static QAtomicPointer<StringDeduplicator> m_Instance;
+	static QAtomicInt m_Generation;
+
+	Shard m_Shards[KEY_SPACES][SHARDS];
+	QAtomicPointer<Entry> m_Blocks[MAX_BLOCKS];
+	QAtomicInt m_NextId;
+
+	// A loaded table's strings stay where they were loaded, in the mapped
+	// file or, if it couldn't be mapped, a copy of it.
+	QFile m_TableFile;
+	uchar* m_TableMapped;
+	QByteArray m_TableCopy;
 };
+
+#endif // STRINGDEDUPLICATOR_H
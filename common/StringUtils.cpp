@@ -9,20 +9,38 @@
 #include "StringUtils.h"
 
 // Library headers.
+#include <QByteArray>
 #include <QRegExp>
 
-StringUtils::Term StringUtils::NextTerm(QString& line, QString& termDest)
+// Common headers.
+#include "DelimiterScanner.h"
+
+StringUtils::Term StringUtils::NextTerm(const QString& line, int& pos,
+	QStringRef& termDest)
 {
 	Term retval = END_OF_LINE;
+	const QChar* data = line.unicode();
+	int end = line.length();
 	int used = 0;
-	
-	termDest.clear();
-	line = line.trimmed();
-	
-	QChar ch = line[0];
-	
-	if (!line.isEmpty())
+
+	// Skipping whitespace at both ends is the same as trimming the rest of
+	// the line, without making a copy of it.
+	while (pos < end && data[pos].isSpace())
 	{
+		pos++;
+	}
+
+	while (end > pos && data[end - 1].isSpace())
+	{
+		end--;
+	}
+
+	int remaining = end - pos;
+
+	if (remaining > 0)
+	{
+		QChar ch = data[pos];
+
 		if (ch == '{')
 		{
 			used++;
@@ -41,7 +59,7 @@ StringUtils::Term StringUtils::NextTerm(QString& line, QString& termDest)
 		else if (ch == '#')
 		{
 			// A comment uses everything left; there's no close-comment marker.
-			used = line.length();
+			used = remaining;
 			retval = COMMENT;
 		}
 		else
@@ -49,57 +67,201 @@ StringUtils::Term StringUtils::NextTerm(QString& line, QString& termDest)
 			bool done = false;
 			bool inQuotes = false;
 			bool valueOnly = false;
-			
-			while (!done && used <= line.length())
+
+			const ushort* start = line.utf16() + pos;
+			const ushort* stop = start + remaining;
+
+			while (!done && used < remaining)
 			{
 				if (inQuotes)
 				{
-					// We need to handle escape characters so we don't
-					// falsely use an escaped quote as a close quote.
-					if (ch == '"')
-					{
-						inQuotes = false;
-					}
-					else if (ch == '\\' && (used + 1) < line.length())
+					// Nothing but a quote or an escape matters in here, so
+					// skip straight to the next one.
+					used = DelimiterScanner::NextQuoteOrEscape(start + used, stop) - start;
+
+					if (used < remaining)
 					{
-						// We don't care what's quoted, just skip over it.
+						// We need to handle escape characters so we don't
+						// falsely use an escaped quote as a close quote.
+						if (start[used] == '"')
+						{
+							inQuotes = false;
+						}
+						else if ((used + 1) < remaining)
+						{
+							// We don't care what's quoted, just skip over it.
+							used++;
+						}
+
 						used++;
 					}
-					
-					used++;
 				}
 				else
 				{
-					if (ch == '#' || ch == '{' || ch == '}' || ch == '=' ||
-						ch.isSpace())
+					// Plain characters can't end the term, so skip them in
+					// bulk and only look closely at what might.
+					used = DelimiterScanner::NextSpecial(start + used, stop) - start;
+
+					if (used < remaining)
 					{
-						done = true;
+						ch = data[pos + used];
+
+						if (ch == '#' || ch == '{' || ch == '}' || ch == '=' ||
+							ch.isSpace())
+						{
+							done = true;
+						}
+						else
+						{
+							// Attributes cannot have quotes or escapes, to
+							// prevent confusion. They also cannot have dots
+							// because those are used in the journal entries
+							// to find the attribute in the file and tree.
+							if (ch == '\\' || ch == '.')
+							{
+								valueOnly = true;
+							}
+							else if (ch == '"')
+							{
+								inQuotes = true;
+							}
+
+							used++;
+						}
 					}
-					else
+				}
+			}
+
+			if (valueOnly)
+			{
+				retval = VALUE_ONLY;
+			}
+			else
+			{
+				retval = ATTRIB_OR_VALUE;
+			}
+		}
+	}
+
+	termDest = QStringRef(&line, pos, used);
+	pos += used;
+
+	return retval;
+}
+
+StringUtils::Term StringUtils::NextTerm(const char* line, int length,
+	int& pos, const char*& termStart, int& termLength)
+{
+	Term retval = END_OF_LINE;
+	int used = 0;
+	int spaceLength = 0;
+
+	while ((spaceLength = Utf8SpaceLength(line + pos, line + length)) > 0)
+	{
+		pos += spaceLength;
+	}
+
+	int remaining = Utf8TrimEnd(line + pos, line + length) - (line + pos);
+
+	if (remaining > 0)
+	{
+		char ch = line[pos];
+
+		if (ch == '{')
+		{
+			used++;
+			retval = OPEN_STRUCT;
+		}
+		else if (ch == '}')
+		{
+			used++;
+			retval = CLOSE_STRUCT;
+		}
+		else if (ch == '=')
+		{
+			used++;
+			retval = EQUALS;
+		}
+		else if (ch == '#')
+		{
+			// A comment uses everything left; there's no close-comment marker.
+			used = remaining;
+			retval = COMMENT;
+		}
+		else
+		{
+			bool done = false;
+			bool inQuotes = false;
+			bool valueOnly = false;
+			const char* start = line + pos;
+			const char* stop = start + remaining;
+
+			// This follows the QString version above; the only difference is
+			// that whitespace outside ASCII takes several bytes.
+			while (!done && used < remaining)
+			{
+				if (inQuotes)
+				{
+					used = DelimiterScanner::NextQuoteOrEscape(start + used, stop) - start;
+
+					if (used < remaining)
 					{
-						// Attributes cannot have quotes or escapes, to
-						// prevent confusion. They also cannot have dots
-						// because those are used in the journal entries to
-						// find the attribute in the file and tree.
-						if (ch == '\\' || ch == '.')
+						if (start[used] == '"')
 						{
-							valueOnly = true;
+							inQuotes = false;
 						}
-						else if (ch == '"')
+						else if ((used + 1) < remaining)
 						{
-							inQuotes = true;
+							used++;
 						}
-						
+
 						used++;
 					}
 				}
-				
-				if (used < line.length())
+				else
 				{
-					ch = line[used];
+					used = DelimiterScanner::NextSpecial(start + used, stop) - start;
+
+					if (used < remaining)
+					{
+						ch = start[used];
+
+						if (static_cast<uchar>(ch) >= 0x80)
+						{
+							uint ucs4 = 0;
+							int charLength = Utf8Length(start + used, stop, ucs4);
+
+							if (QChar::isSpace(ucs4))
+							{
+								done = true;
+							}
+							else
+							{
+								used += charLength;
+							}
+						}
+						else if (ch == '#' || ch == '{' || ch == '}' ||
+							ch == '=' || QChar::isSpace(static_cast<uint>(ch)))
+						{
+							done = true;
+						}
+						else
+						{
+							if (ch == '\\' || ch == '.')
+							{
+								valueOnly = true;
+							}
+							else if (ch == '"')
+							{
+								inQuotes = true;
+							}
+
+							used++;
+						}
+					}
 				}
 			}
-			
+
 			if (valueOnly)
 			{
 				retval = VALUE_ONLY;
@@ -110,15 +272,22 @@ StringUtils::Term StringUtils::NextTerm(QString& line, QString& termDest)
 			}
 		}
 	}
-	
-	termDest = line.left(used);
-	line = line.remove(0, used);
+
+	termStart = line + pos;
+	termLength = used;
+	pos += used;
 
 	return retval;
 }
 
 StringUtils::ValueError StringUtils::UnquoteTerm(const QString& term,
 	QString& termDest)
+{
+	return UnquoteTerm(QStringRef(&term), termDest);
+}
+
+StringUtils::ValueError StringUtils::UnquoteTerm(const QStringRef& term,
+	QString& termDest)
 {
 	ValueError retval = VALUE_OK;
 	bool done = false;
@@ -141,17 +310,17 @@ StringUtils::ValueError StringUtils::UnquoteTerm(const QString& term,
 				ok = false;
 				retval = VALUE_MISSING_QUOTE;
 			}
-			if (term[pos] == '"')
+			else if (term.at(pos) == '"')
 			{
 				inQuotes = false;
 			}
-			else if (term[pos] == '\\')
+			else if (term.at(pos) == '\\')
 			{
 				// Escape must be followed by a character.
 				if ((pos + 1) < term.length())
 				{
 					pos++;
-					termDest.push_back(term[pos]);
+					termDest.push_back(term.at(pos));
 				}
 				else
 				{
@@ -162,28 +331,28 @@ StringUtils::ValueError StringUtils::UnquoteTerm(const QString& term,
 			}
 			else
 			{
-				termDest.push_back(term[pos]);
+				termDest.push_back(term.at(pos));
 			}
 		}
 		else
 		{
 			// We're not inside quotes, so whitespace or EOL marks our end.
-			if (pos == term.length() || term[pos].isSpace())
+			if (pos == term.length() || term.at(pos).isSpace())
 			{
 				done = true;
 			}
-			else if (term[pos] == '"')
+			else if (term.at(pos) == '"')
 			{
 				inQuotes = true;
 			}
-			else if (term[pos] == '\\')
+			else if (term.at(pos) == '\\')
 			{
 				done = true;
 				retval = VALUE_UNQUOTED_ESCAPE;
 			}
 			else
 			{
-				termDest.push_back(term[pos]);
+				termDest.push_back(term.at(pos));
 			}
 		}
 		
@@ -203,6 +372,104 @@ StringUtils::ValueError StringUtils::UnquoteTerm(const QString& term,
 	return retval;
 }
 
+StringUtils::ValueError StringUtils::UnquoteTerm(const char* term, int length,
+	QString& termDest)
+{
+	ValueError retval = VALUE_OK;
+
+	// Most values are plain ASCII words or numbers, which come out exactly
+	// as they went in.
+	if (DelimiterScanner::NextSpecial(term, term + length) == term + length)
+	{
+		termDest = QString::fromLatin1(term, length);
+		return retval;
+	}
+
+	QByteArray utf8;
+	bool done = false;
+	bool inQuotes = false;
+	bool ok = true;
+	int pos = 0;
+
+	utf8.reserve(length);
+
+	// As the QString version, except an escaped character may be several
+	// bytes long.
+	while (ok && !done)
+	{
+		if (inQuotes)
+		{
+			if (pos == length)
+			{
+				done = true;
+				ok = false;
+				retval = VALUE_MISSING_QUOTE;
+			}
+			else if (term[pos] == '"')
+			{
+				inQuotes = false;
+			}
+			else if (term[pos] == '\\')
+			{
+				if ((pos + 1) < length)
+				{
+					uint ucs4 = 0;
+					pos++;
+					int charLength = Utf8Length(term + pos, term + length, ucs4);
+					utf8.append(term + pos, charLength);
+					pos += charLength - 1;
+				}
+				else
+				{
+					done = true;
+					ok = false;
+					retval = VALUE_UNFINISHED_ESCAPE;
+				}
+			}
+			else
+			{
+				utf8.append(term[pos]);
+			}
+		}
+		else
+		{
+			if (pos == length || Utf8SpaceLength(term + pos, term + length) > 0)
+			{
+				done = true;
+			}
+			else if (term[pos] == '"')
+			{
+				inQuotes = true;
+			}
+			else if (term[pos] == '\\')
+			{
+				done = true;
+				retval = VALUE_UNQUOTED_ESCAPE;
+			}
+			else
+			{
+				utf8.append(term[pos]);
+			}
+		}
+
+		if (!done)
+		{
+			pos++;
+		}
+	}
+
+	if (!ok || pos <= 0)
+	{
+		termDest.clear();
+	}
+	else
+	{
+		termDest = QString::fromUtf8(utf8);
+	}
+
+	return retval;
+}
+
 QString StringUtils::QuoteTerm(const QString& term, bool always)
 {
 	QString retval("");
@@ -238,6 +505,62 @@ QString StringUtils::QuoteTerm(const QString& term, bool always)
 	return retval;
 }
 
+bool StringUtils::ParseInteger(const QString& term, qint64& valueDest)
+{
+	bool retval = false;
+
+	// Anything longer has too many digits.
+	if (term.length() <= 19)
+	{
+		char digits[20];
+		int length = term.length();
+
+		for (int count = 0; count < length; count++)
+		{
+			ushort ch = term[count].unicode();
+			digits[count] = (ch < 0x80) ? static_cast<char>(ch) : 'x';
+		}
+
+		retval = ParseInteger(digits, length, valueDest);
+	}
+
+	return retval;
+}
+
+bool StringUtils::ParseInteger(const char* term, int length, qint64& valueDest)
+{
+	bool retval = false;
+	bool negative = (length > 0 && term[0] == '-');
+	int start = negative ? 1 : 0;
+	int digits = length - start;
+
+	if (digits >= 1 && digits <= 18 &&
+		(term[start] != '0' || (digits == 1 && !negative)))
+	{
+		qint64 value = 0;
+		retval = true;
+
+		for (int count = start; retval && count < length; count++)
+		{
+			if (term[count] >= '0' && term[count] <= '9')
+			{
+				value = value * 10 + (term[count] - '0');
+			}
+			else
+			{
+				retval = false;
+			}
+		}
+
+		if (retval)
+		{
+			valueDest = negative ? -value : value;
+		}
+	}
+
+	return retval;
+}
+
 bool StringUtils::MustQuote(const QString& term)
 {
 	bool retval = false;
@@ -253,3 +576,135 @@ bool StringUtils::MustQuote(const QString& term)
 
 	return retval;
 }
+
+int StringUtils::Utf8Length(const char* pos, const char* end, uint& ucs4)
+{
+	int retval = 1;
+	uchar lead = static_cast<uchar>(*pos);
+
+	// Anything malformed is taken one byte at a time and is never a space,
+	// which matches what QString::fromUtf8 would turn it into.
+	ucs4 = 0xfffd;
+
+	if (lead < 0x80)
+	{
+		ucs4 = lead;
+	}
+	else
+	{
+		int extra = 0;
+		uint minimum = 0;
+		uint value = 0;
+
+		if ((lead & 0xe0) == 0xc0)
+		{
+			extra = 1;
+			minimum = 0x80;
+			value = lead & 0x1f;
+		}
+		else if ((lead & 0xf0) == 0xe0)
+		{
+			extra = 2;
+			minimum = 0x800;
+			value = lead & 0x0f;
+		}
+		else if ((lead & 0xf8) == 0xf0)
+		{
+			extra = 3;
+			minimum = 0x10000;
+			value = lead & 0x07;
+		}
+
+		if (extra > 0 && (end - pos) > extra)
+		{
+			bool ok = true;
+
+			for (int count = 1; ok && count <= extra; count++)
+			{
+				uchar next = static_cast<uchar>(pos[count]);
+				ok = ((next & 0xc0) == 0x80);
+				value = (value << 6) | (next & 0x3f);
+			}
+
+			if (ok && value >= minimum && value <= 0x10ffff)
+			{
+				ucs4 = value;
+				retval = extra + 1;
+			}
+		}
+	}
+
+	return retval;
+}
+
+void StringUtils::TrimUtf8(const char*& line, int& length)
+{
+	const char* end = Utf8TrimEnd(line, line + length);
+	int spaceLength = 0;
+
+	while ((spaceLength = Utf8SpaceLength(line, end)) > 0)
+	{
+		line += spaceLength;
+	}
+
+	length = end - line;
+}
+
+int StringUtils::Utf8SpaceLength(const char* pos, const char* end)
+{
+	int retval = 0;
+
+	if (pos < end)
+	{
+		uchar lead = static_cast<uchar>(*pos);
+
+		if (lead < 0x80)
+		{
+			if (QChar::isSpace(static_cast<uint>(lead)))
+			{
+				retval = 1;
+			}
+		}
+		else
+		{
+			uint ucs4 = 0;
+			int charLength = Utf8Length(pos, end, ucs4);
+
+			if (QChar::isSpace(ucs4))
+			{
+				retval = charLength;
+			}
+		}
+	}
+
+	return retval;
+}
+
+const char* StringUtils::Utf8TrimEnd(const char* begin, const char* end)
+{
+	bool done = false;
+
+	while (!done && end > begin)
+	{
+		const char* last = end - 1;
+
+		// Back up to the start of the final character; no UTF-8 character
+		// is longer than 4 bytes.
+		while (last > begin && (end - last) < 4 &&
+			(static_cast<uchar>(*last) & 0xc0) == 0x80)
+		{
+			last--;
+		}
+
+		if (Utf8SpaceLength(last, end) == (end - last))
+		{
+			end = last;
+		}
+		else
+		{
+			done = true;
+		}
+	}
+
+	return end;
+}
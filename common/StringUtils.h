@@ -10,6 +10,7 @@
 
 // Library headers.
 #include <QString>
+#include <QStringRef>
 
 class StringUtils
 {
@@ -31,15 +32,41 @@ public:
 		VALUE_UNQUOTED_ESCAPE
 	};
 	
-	static Term NextTerm(QString& line, QString& termDest);
+	// Walks the line from pos without modifying or copying it. On return
+	// termDest refers to the term inside line and pos is just past it.
+	static Term NextTerm(const QString& line, int& pos, QStringRef& termDest);
+
+	// The same for a line of UTF-8 bytes, so it never has to be converted to
+	// a QString. termStart points into line and termLength is in bytes.
+	static Term NextTerm(const char* line, int length, int& pos,
+		const char*& termStart, int& termLength);
+
 	static ValueError UnquoteTerm(const QString& term, QString& termDest);
+	static ValueError UnquoteTerm(const QStringRef& term, QString& termDest);
+	static ValueError UnquoteTerm(const char* term, int length, QString& termDest);
 
 	// By default this will only add quotes, backslashes etc if the term
 	// needs them, to avoid things like "layer=1000" winding up with quotes.
 	static QString QuoteTerm(const QString& term, bool always = false);
+
+	// Only plain decimal text which formats back to exactly the same text
+	// counts, so "1000" and "-5" do, but "007", "+5", "-0" and "1e3" don't.
+	// At most 18 digits, so it always fits.
+	static bool ParseInteger(const QString& term, qint64& valueDest);
+	static bool ParseInteger(const char* term, int length, qint64& valueDest);
+
+	// Trim UTF-8 text the way QString::trimmed would, without converting
+	// it: on return line and length only cover what's between the spaces.
+	static void TrimUtf8(const char*& line, int& length);
+
+	// Bytes in the whitespace character at pos, or 0 if it isn't one.
+	static int Utf8SpaceLength(const char* pos, const char* end);
 	
 private:
 	static bool MustQuote(const QString& term);
+
+	static int Utf8Length(const char* pos, const char* end, uint& ucs4);
+	static const char* Utf8TrimEnd(const char* begin, const char* end);
 };
 
 #endif // STRINGUTILS_H